@@ -1,18 +1,38 @@
 /*
 **计算两个向量a和b之间的距离。公共接口由CalculateDistance类提供。*
 **具体类实例由CreateCalculator类负责生成        *
+**各种距离度量的向量化实现见DistanceKernels.hpp*
 */
 #ifndef CALCULATEDISTANCE_HPP_
 #define CALCULATEDISTANCE_HPP_
 
 #include <string>
 #include <memory>
+#include <iostream>
 #include <cmath>
+#include <utility>
+#include <algorithm>
 #include "caffe/util/math_functions.hpp"
+#include "DistanceKernels.hpp"
 
 using std::string;
 using std::shared_ptr;
 
+//一批帧对的总计算量(浮点数个数)超过该值时才用OpenMP并行，否则线程的开销比计算还大
+const size_t kParallelWork = 1 << 20;
+
+//对pairs中的每一对向量调用distance，结果写入distances
+//第k对向量为base + pairs[k].first * stride和base + pairs[k].second * stride
+//计算量足够大时用OpenMP的静态调度把帧对平均分成连续的几段，每个线程处理一段，不做额外的缓存分块
+template <typename T, typename Distance>
+void calculatePairs(const T *base, size_t stride, const std::pair<int,int> *pairs, int num_pairs, int n, T *distances,
+    Distance distance)
+{
+#pragma omp parallel for schedule(static) if(static_cast<size_t>(num_pairs) * n >= kParallelWork)
+    for(int k = 0; k < num_pairs; ++k)
+        distances[k] = distance(base + pairs[k].first * stride, base + pairs[k].second * stride, n);
+}
+
 //计算两个向量之间的距离
 template <typename T>
 class CalculateDistance{
@@ -20,8 +40,32 @@ public:
     virtual ~CalculateDistance(){}
     virtual std::string type() = 0;
     virtual T calculate(const T *a, const T *b,int n )= 0;
+    //一次计算num_pairs对n维向量之间的距离，向量都在以base开始、每行stride个元素的矩阵中，
+    //第k对为第pairs[k].first行和第pairs[k].second行，距离写入distances[k]
+    //默认逐对调用calculate()，子类重写后每批只有一次虚函数调用
+    virtual void calculate_batch(const T *base, size_t stride, const std::pair<int,int> *pairs, int num_pairs, int n,
+        T *distances)
+    {
+        calculatePairs(base, stride, pairs, num_pairs, n, distances,
+            [this](const T *a, const T *b, int n){return calculate(a, b, n);});
+    }
+    //返回一个在每个向量都已经L2归一化(见normalizeRows)时结果相同、但计算更快的对象，没有时返回空
+    virtual shared_ptr<CalculateDistance<T>> normalizedCalculator() {return shared_ptr<CalculateDistance<T>>();}
 };
 
+//把data中的num个dim维向量分别归一化为单位长度，全零的向量保持不变
+template <typename T>
+void normalizeRows(T *data, int num, int dim)
+{
+    for(int i = 0; i < num; ++i)
+    {
+        T *row = data + static_cast<size_t>(i) * dim;
+        T norm = std::sqrt(caffe::caffe_cpu_dot(dim, row, row));
+        if(norm > 0)
+            caffe::caffe_scal(dim, T(1) / norm, row);
+    }
+}
+
 //用于生成具体类的简单工厂
 //这儿模板类的引用，有点问题，暂时使用下面的具体类来生成类实例
 template <typename T>
@@ -41,26 +85,71 @@ class CosineDistance :public CalculateDistance<T>{
 public:
     virtual std::string type() {return "Cosine";}
     virtual T calculate(const T *a, const T *b, int n);    
+    virtual void calculate_batch(const T *base, size_t stride, const std::pair<int,int> *pairs, int num_pairs, int n,
+        T *distances)
+    {
+        calculatePairs(base, stride, pairs, num_pairs, n, distances, KernelFunctor<T>(kCosine, n));
+    }
+    virtual shared_ptr<CalculateDistance<T>> normalizedCalculator();
+};
+
+
+//输入向量都已经归一化时的余弦距离，只需要一次点积
+template <typename T>
+class NormalizedCosineDistance :public CalculateDistance<T>{
+public:
+    virtual std::string type() {return "Cosine";}
+    virtual T calculate(const T *a, const T *b, int n) {return 1 - caffe::caffe_cpu_dot(n,a,b);}
+    virtual void calculate_batch(const T *base, size_t stride, const std::pair<int,int> *pairs, int num_pairs, int n,
+        T *distances)
+    {
+        calculatePairs(base, stride, pairs, num_pairs, n, distances,
+            [](const T *a, const T *b, int n){return 1 - caffe::caffe_cpu_dot(n,a,b);});
+    }
 };
 
+template <typename T>
+shared_ptr<CalculateDistance<T>> CosineDistance<T>::normalizedCalculator()
+{
+    return shared_ptr<CalculateDistance<T>>(new NormalizedCosineDistance<T>());
+}
 
+//一次遍历同时计算点积和两个向量的模长
 template <typename T>
 T CosineDistance<T>::calculate(const T *a, const T *b, int n)
 {
-    T dot_product = caffe::caffe_cpu_dot(n,a,b);
-    return 1 - dot_product / 
-            (std::sqrt(caffe::caffe_cpu_dot(n,a,a)) *
-            std::sqrt(caffe::caffe_cpu_dot(n,b,b)));
+    return computeDistance(kCosine, a, b, n);
 }
 
+//Cosine以外的距离度量，直接调用DistanceKernels.hpp中的实现
+template <typename T>
+class KernelDistance :public CalculateDistance<T>{
+public:
+    KernelDistance(const string &type, KernelMetric metric):m_type(type),m_metric(metric){}
+    virtual std::string type() {return m_type;}
+    virtual T calculate(const T *a, const T *b, int n) {return computeDistance(m_metric, a, b, n);}
+    virtual void calculate_batch(const T *base, size_t stride, const std::pair<int,int> *pairs, int num_pairs, int n,
+        T *distances)
+    {
+        calculatePairs(base, stride, pairs, num_pairs, n, distances, KernelFunctor<T>(m_metric, n));
+    }
+private:
+    string m_type;
+    KernelMetric m_metric;
+};
+
+//未知的距离类型返回空指针，由调用者处理
 template <typename T>
 shared_ptr<CalculateDistance<T>> CreateCalculator<T>::create(string type)
 {
-    if(type == "Cosine")
-        return shared_ptr<CalculateDistance<T>>(new CosineDistance<T>());
-    else{
-        std::cerr << "Unknown distance type" << std::endl;
-        exit(1);
+    KernelMetric metric;
+    if(!kernelMetricFromName(type, metric))
+    {
+        std::cerr << "Unknown distance type " << type << std::endl;
+        return shared_ptr<CalculateDistance<T>>();
     }
+    if(metric == kCosine)
+        return shared_ptr<CalculateDistance<T>>(new CosineDistance<T>());
+    return shared_ptr<CalculateDistance<T>>(new KernelDistance<T>(type, metric));
 }
 #endif
\ No newline at end of file
@@ -1,19 +1,140 @@
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "caffe/util/format.hpp"
 #include "ExtractDataFromDB.hpp"
 
+//解析protobuf中的varint，成功时p指向下一个字段
+static bool readVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+//直接从序列化的Datum中取出float_data(字段6)，写入dst中的前dim个元素，不构造Datum对象
+//float_data可能是逐个编码的fixed32，也可能是packed编码，其他字段直接跳过
+//返回float_data中元素的个数，格式错误时返回-1
+static int parseFloatData(const char *value, size_t size, float *dst, int dim)
+{
+    const int kFloatDataField = 6;
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(value);
+    const uint8_t *end = p + size;
+    int count = 0;
+    while(p < end)
+    {
+        uint64_t tag = 0, length = 0;
+        if(!readVarint(p, end, tag))
+            return -1;
+        int field = tag >> 3;
+        switch(tag & 7)
+        {
+        case 0:     //varint
+            if(!readVarint(p, end, length))
+                return -1;
+            break;
+        case 1:     //fixed64
+            p += 8;
+            break;
+        case 2:     //length-delimited
+            if(!readVarint(p, end, length) || length > static_cast<uint64_t>(end - p))
+                return -1;
+            if(field == kFloatDataField)
+            {
+                int n = length / sizeof(float);
+                if(count < dim)
+                    std::memcpy(dst + count, p, std::min(n, dim - count) * sizeof(float));
+                count += n;
+            }
+            p += length;
+            break;
+        case 5:     //fixed32
+            if(field == kFloatDataField && count < dim && p + sizeof(float) <= end)
+                std::memcpy(dst + count, p, sizeof(float));
+            if(field == kFloatDataField)
+                ++count;
+            p += 4;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return p == end ? count : -1;
+}
+
 ExtractDataFromDB::ExtractDataFromDB(const string& db_file,const string & db_backend)
+    :m_env(nullptr),m_txn(nullptr),m_mdb_cursor(nullptr),m_mdb_valid(false),m_prefetch_size(0),m_head_rows(0)
 {
+    m_acquired[0] = m_acquired[1] = nullptr;
+    if(db_backend == "lmdb")
+    {
+        CHECK_EQ(mdb_env_create(&m_env), MDB_SUCCESS) << "mdb_env_create failed";
+        int rc = mdb_env_open(m_env, db_file.c_str(), MDB_RDONLY | MDB_NOTLS, 0664);
+        CHECK_EQ(rc, MDB_SUCCESS) << db_file << ": " << mdb_strerror(rc);
+        MDB_dbi dbi;
+        CHECK_EQ(mdb_txn_begin(m_env, NULL, MDB_RDONLY, &m_txn), MDB_SUCCESS);
+        CHECK_EQ(mdb_dbi_open(m_txn, NULL, 0, &dbi), MDB_SUCCESS);
+        CHECK_EQ(mdb_cursor_open(m_txn, dbi, &m_mdb_cursor), MDB_SUCCESS);
+        m_mdb_valid = mdb_cursor_get(m_mdb_cursor, &m_mdb_key, &m_mdb_value, MDB_FIRST) == MDB_SUCCESS;
+        return;
+    }
     m_db.reset(db::GetDB(db_backend));
     m_db->Open(db_file,db::READ);
     m_cursor.reset(m_db->NewCursor());
 
 }
 
+ExtractDataFromDB::~ExtractDataFromDB()
+{
+    stopPrefetch();
+    if(m_env != nullptr)
+    {
+        mdb_cursor_close(m_mdb_cursor);
+        mdb_txn_abort(m_txn);
+        mdb_env_close(m_env);
+    }
+}
+
+//获得当前记录的键和值，lmdb时直接指向内存映射的页
+bool ExtractDataFromDB::current(const char *&key, size_t &key_size, const char *&value, size_t &value_size)
+{
+    if(!valid())
+        return false;
+    if(m_env != nullptr)
+    {
+        key = static_cast<const char*>(m_mdb_key.mv_data);
+        key_size = m_mdb_key.mv_size;
+        value = static_cast<const char*>(m_mdb_value.mv_data);
+        value_size = m_mdb_value.mv_size;
+    }else
+    {
+        m_key_buffer = m_cursor->key();
+        m_value_buffer = m_cursor->value();
+        key = m_key_buffer.data();
+        key_size = m_key_buffer.size();
+        value = m_value_buffer.data();
+        value_size = m_value_buffer.size();
+    }
+    return true;
+}
+
 //获得单个样本的特征，成功返回true
 bool ExtractDataFromDB::getRecord(caffe::Datum &datum)
 {
-    if(m_cursor->valid()){
+    const char *key, *value;
+    size_t key_size, value_size;
+    if(current(key, key_size, value, value_size)){
 
-        datum.ParseFromString(m_cursor->value());
+        datum.ParseFromArray(value, value_size);
         return true;
     }else
         return false;
@@ -21,21 +142,141 @@ bool ExtractDataFromDB::getRecord(caffe::Datum &datum)
 
 void ExtractDataFromDB::next()
 {
+    if(m_env != nullptr)
+    {
+        if(m_mdb_valid)
+            m_mdb_valid = mdb_cursor_get(m_mdb_cursor, &m_mdb_key, &m_mdb_value, MDB_NEXT) == MDB_SUCCESS;
+        return;
+    }
     if(m_cursor->valid())
         m_cursor->Next();
 }
 
 bool ExtractDataFromDB::valid()
 {
+    if(m_env != nullptr)
+        return m_mdb_valid;
     return m_cursor->valid();
 }
 
 bool ExtractDataFromDB::getKey(string &key)
 {
-    if(m_cursor->valid()){
+    const char *key_data, *value;
+    size_t key_size, value_size;
+    if(current(key_data, key_size, value, value_size)){
 
-        key = m_cursor->key();
+        key.assign(key_data, key_size);
         return true;
     }else
         return false;
-}
\ No newline at end of file
+}
+
+//键是用10位数字表示的帧序号，字典序和数值的顺序一致
+bool ExtractDataFromDB::seek(int frame_no)
+{
+    CHECK_EQ(m_prefetch_size, 0) << "cannot seek while prefetching";
+    string key = caffe::format_int(frame_no, 10);
+    if(m_env != nullptr)
+    {
+        m_mdb_key.mv_data = const_cast<char*>(key.data());
+        m_mdb_key.mv_size = key.size();
+        m_mdb_valid = mdb_cursor_get(m_mdb_cursor, &m_mdb_key, &m_mdb_value, MDB_SET_RANGE) == MDB_SUCCESS;
+        return m_mdb_valid;
+    }
+    //caffe::db::Cursor没有按键定位的接口，从头开始查找
+    m_cursor->SeekToFirst();
+    while(m_cursor->valid() && m_cursor->key() < key)
+        m_cursor->Next();
+    return m_cursor->valid();
+}
+
+int ExtractDataFromDB::readRecords(float *data, int num, int dim, int *frame_nos)
+{
+    const char *key, *value;
+    size_t key_size, value_size;
+    int j = 0;
+    for(; j < num && current(key, key_size, value, value_size); ++j, next())
+    {
+        int count = parseFloatData(value, value_size, data + static_cast<size_t>(j) * dim, dim);
+        CHECK_EQ(count, dim) << "the record " << string(key, key_size) << " does not have " << dim << " float features";
+        if(frame_nos != nullptr)
+            frame_nos[j] = std::stoi(string(key, key_size));
+    }
+    return j;
+}
+
+int ExtractDataFromDB::readBatch(float *data, int num, int dim, int *frame_nos)
+{
+    if(m_prefetch_size == 0)
+        return readRecords(data, num, dim, frame_nos);
+    CHECK_EQ(num, m_prefetch_size) << "the batch size must equal the prefetch batch size";
+    Batch *batch = nullptr;
+    if(!m_ready_batches->pop(batch))
+        return 0;
+    int n = batch->frame_nos.size();
+    const size_t head = static_cast<size_t>(m_head_rows) * dim;
+    std::copy(batch->data.begin() + head, batch->data.begin() + head + static_cast<size_t>(n) * dim, data);
+    if(frame_nos != nullptr)
+        std::copy(batch->frame_nos.begin(), batch->frame_nos.end(), frame_nos);
+    m_free_batches->push(batch);
+    return n;
+}
+
+int ExtractDataFromDB::acquireBatch(float *&rows, const int *&frame_nos)
+{
+    CHECK_GT(m_prefetch_size, 0) << "acquireBatch is only available while prefetching";
+    CHECK_GE(m_batches.size(), 3) << "acquireBatch keeps two batches, the prefetch depth must >= 3";
+    Batch *batch = nullptr;
+    if(!m_ready_batches->pop(batch))
+        return 0;
+    //更早取得的batch不再被调用者使用，交给后台线程继续读取
+    if(m_acquired[0] != nullptr)
+        m_free_batches->push(m_acquired[0]);
+    m_acquired[0] = m_acquired[1];
+    m_acquired[1] = batch;
+    rows = batch->data.data();
+    frame_nos = batch->frame_nos.data();
+    return batch->frame_nos.size();
+}
+
+void ExtractDataFromDB::startPrefetch(int batch_size, int dim, int depth, int head_rows)
+{
+    stopPrefetch();
+    m_batches.resize(depth);
+    m_head_rows = head_rows;
+    m_acquired[0] = m_acquired[1] = nullptr;
+    m_free_batches.reset(new BlockingQueue<Batch*>(depth));
+    m_ready_batches.reset(new BlockingQueue<Batch*>(depth));
+    for(auto &batch : m_batches)
+    {
+        batch.data.resize(static_cast<size_t>(head_rows + batch_size) * dim);
+        batch.frame_nos.resize(batch_size);
+        m_free_batches->push(&batch);
+    }
+    m_prefetch_size = batch_size;
+    m_prefetcher = std::thread([this, batch_size, dim, head_rows]{
+        Batch *batch = nullptr;
+        while(m_free_batches->pop(batch))
+        {
+            batch->frame_nos.resize(batch_size);
+            int n = readRecords(batch->data.data() + static_cast<size_t>(head_rows) * dim, batch_size, dim, batch->frame_nos.data());
+            batch->frame_nos.resize(n);
+            if(n > 0 && !m_ready_batches->push(batch))
+                break;
+            if(n < batch_size)
+                break;
+        }
+        m_ready_batches->close();
+    });
+}
+
+void ExtractDataFromDB::stopPrefetch()
+{
+    if(m_prefetch_size == 0)
+        return;
+    m_free_batches->close();
+    m_ready_batches->close();
+    m_prefetcher.join();
+    m_prefetch_size = 0;
+    m_acquired[0] = m_acquired[1] = nullptr;
+}
@@ -4,25 +4,70 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <thread>
+
+#include <lmdb.h>
 
 #include "caffe/util/db.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "BlockingQueue.hpp"
 
 using std::string;
 using std::shared_ptr;
+using std::vector;
 namespace db = caffe::db;
 
 //用于从db文件中提取单个图像样本的特征
+//lmdb直接使用原生的接口，记录的值直接从内存映射的页中读取，不经过caffe::db拷贝
 class ExtractDataFromDB{
 private:
     shared_ptr<db::DB> m_db;
     shared_ptr<db::Cursor> m_cursor;
+    //lmdb的原生句柄，m_env为nullptr时使用m_cursor
+    MDB_env *m_env;
+    MDB_txn *m_txn;
+    MDB_cursor *m_mdb_cursor;
+    MDB_val m_mdb_key, m_mdb_value;
+    bool m_mdb_valid;
+    string m_key_buffer, m_value_buffer;    //非lmdb时当前记录的拷贝
+
+    //预取：后台线程提前读取之后的batch，读取的结果在m_batches中循环使用
+    //每个batch的data在样本之前保留m_head_rows行，样本从第m_head_rows行开始
+    struct Batch{
+        vector<float> data;
+        vector<int> frame_nos;
+    };
+    vector<Batch> m_batches;
+    shared_ptr<BlockingQueue<Batch*>> m_free_batches, m_ready_batches;
+    std::thread m_prefetcher;
+    int m_prefetch_size;
+    int m_head_rows;
+    Batch *m_acquired[2];   //acquireBatch最近两次取得的batch，[1]为最新的
+
+    bool current(const char *&key, size_t &key_size, const char *&value, size_t &value_size);
+    int readRecords(float *data, int num, int dim, int *frame_nos);
 public:
     ExtractDataFromDB(const string &db_file, const string &db_backend);
-    ~ExtractDataFromDB(){}
+    ~ExtractDataFromDB();
     bool getRecord(caffe::Datum &data);//获得一个图像样本的特征
     bool getKey(string &key);
     void next();
-    bool valid();   //当前的记录是否有效    
+    bool valid();   //当前的记录是否有效
+    bool seek(int frame_no);    //定位到第一个序号不小于frame_no的记录，不存在时返回false
+    //从当前记录开始读取最多num个连续样本的特征，第j个样本的特征写入data + j * dim，序号写入frame_nos[j](可以为nullptr)
+    //直接解析记录中的float_data，不构造Datum，返回实际读取的样本数，读到结尾时小于num
+    //预取时从预取的batch中拷贝到data，不需要拷贝时使用acquireBatch
+    int readBatch(float *data, int num, int dim, int *frame_nos = nullptr);
+    //启动后台线程，提前读取depth个大小为batch_size的batch，之后readBatch的num必须等于batch_size
+    //每个batch的缓冲区在样本之前保留head_rows行，供acquireBatch的调用者存放之前的样本
+    //预取期间不能调用其他读取或定位的函数
+    void startPrefetch(int batch_size, int dim, int depth = 2, int head_rows = 0);
+    //预取时直接取得下一个batch的缓冲区，不拷贝样本：rows指向缓冲区的开头，前head_rows行由调用者使用，
+    //之后是各个样本的特征，frame_nos指向样本的序号。返回样本数，读到结尾时返回0
+    //最近两次取得的缓冲区都保持有效，调用者可以修改其中的数据，也可以从上一个缓冲区拷贝需要保留的行；
+    //因此depth至少为3，后台线程才能同时读取下一个batch
+    int acquireBatch(float *&rows, const int *&frame_nos);
+    void stopPrefetch();
 };
-#endif
\ No newline at end of file
+#endif
@@ -2,8 +2,7 @@
 #include <string>
 #include <utility>
 #include <fstream>
-#include <iomanip>
-#include <list>
+#include <algorithm>
 
 #include <glog/logging.h>
 
@@ -11,85 +10,183 @@
 
 #include "CalculateDistance.hpp"
 #include "ExtractDataFromDB.hpp"
+#include "FeatureFile.hpp"
+#include "FilterEngine.hpp"
 
 
 using std::pair;
 using std::vector;
 using std::string;
 
-vector<int> merger_candidates(vector<vector<int>> &candidates_at_all_sampleRates);
-//从db文件中获取采样的视频的特征，计算相邻帧之间的距离,获得相似度序列
+void getSimilaritiesSquenceFromFile(const string &features_file, const vector<int> &sampleRates, string type,
+    vector<vector<pair<int,float>>> &all_similarities);
+//从db文件中获取采样的视频的特征，计算相邻帧之间的距离,获得所有采样率上的相似度序列
+//只遍历一次db文件，按batch读取特征，并保留最近的max(sampleRates)帧的特征，同时计算所有采样率上的距离
 //features_db:包含单个视频中所有帧图像的特征的db文件
-//db_type: db文件的类型 leveldb, lmdb
-//sampleRate: 采样率
-//type: 距离度量的类型，目前有Cosine
-//similarities: 相似度序列，每一项表示(帧序号，和下一个采样帧的相似度)
+//db_type: db文件的类型 leveldb, lmdb, binary(FeatureFile.hpp格式的二进制特征文件)
+//sampleRates: 采样率序列
+//type: 距离度量的类型，目前有Cosine, L2, L1, ChiSquare, HistIntersection, Hamming
+//all_similarities: all_similarities[i]是第i个采样率上的相似度序列，每一项表示(帧序号，和下一个采样帧的相似度)
 
-void getSimilaritiesSquence(const string &features_db, const string &db_type, int sampleRate, string type,
-    vector<pair<int,float>> &similarities)
+void getSimilaritiesSquence(const string &features_db, const string &db_type, const vector<int> &sampleRates, string type,
+    vector<vector<pair<int,float>>> &all_similarities)
 {
+    all_similarities.assign(sampleRates.size(), vector<pair<int,float>>());
+    if(db_type == "binary")
+    {
+        getSimilaritiesSquenceFromFile(features_db, sampleRates, type, all_similarities);
+        return;
+    }
     ExtractDataFromDB extractor(features_db, db_type);
-    caffe::Datum features[2];   //用于存放相邻两帧的特征，原始数据
-    string keys[2];//用于存放相邻两帧的索引  
-    float* featureVectors[2];//用于存放特征向量  
-    int index = 0;  //当前计算的采样帧存放在features[index]中
-
-    if(extractor.getKey(keys[index]))
+    caffe::Datum datum;
+    if(!extractor.getRecord(datum))
+        return;
+    //计算特征向量的维度
+    const int nums = datum.channels() * datum.height() * datum.width();
+    shared_ptr<CalculateDistance<float>> calculator = CreateCalculator<float>().create(type);
+    //距离度量在归一化的特征上有更快的算法时，每一帧读入后只归一化一次，被所有采样率复用
+    shared_ptr<CalculateDistance<float>> normalized_calculator = calculator->normalizedCalculator();
+    if(normalized_calculator)
+        calculator = normalized_calculator;
+    const int max_rate = *std::max_element(sampleRates.begin(), sampleRates.end());
+    //特征矩阵直接使用预取的缓冲区，batch中的样本不再拷贝：前max_rate行是之前读取的最后max_rate帧，之后是当前batch，
+    //第pos帧和前一个采样帧pos - rate在矩阵中相隔rate行
+    const int batch_size = 64;
+    vector<int> frame_nos(max_rate + batch_size);
+    //每个batch中要比较的帧对(矩阵中的行号)，以及每一对所属的采样率
+    vector<pair<int,int>> pairs;
+    vector<size_t> pair_rates;
+    vector<float> distances;
+    extractor.startPrefetch(batch_size, nums, 3, max_rate);
+    int pos = 0;    //当前batch中第一帧在db中的位置
+    int n = 0, previous_n = 0;
+    float *features = nullptr, *previous_features = nullptr;
+    const int *batch_frame_nos = nullptr;
+    while((n = extractor.acquireBatch(features, batch_frame_nos)) > 0)
     {
-        extractor.getRecord(features[index]);
-        //计算特征向量的维度
-        const int datum_channels = features[index].channels();
-        const int datum_height = features[index].height();
-        const int datum_width = features[index].width();
-        const int nums = datum_channels * datum_height *datum_width;
-        featureVectors[0] = new float[nums];
-        featureVectors[1] = new float[nums];
-
-        for(int i = 0; i < nums; ++i)
-            featureVectors[index][i] = features[index].float_data(i);
-        
-        shared_ptr<CalculateDistance<float>> calculator = CreateCalculator<float>().create(type);
-
-        //获得下一个采样帧
-        int step = 0;
-        while(step < sampleRate)
+        float *batch_data = features + static_cast<size_t>(max_rate) * nums;
+        //把上一个矩阵的最后max_rate行拷贝到当前矩阵的开头
+        if(previous_features != nullptr)
         {
-            extractor.next();
-            if(!extractor.valid())
-                break;
-            ++step;
+            std::copy(previous_features + static_cast<size_t>(previous_n) * nums,
+                previous_features + static_cast<size_t>(previous_n + max_rate) * nums, features);
+            std::copy(frame_nos.begin() + previous_n, frame_nos.begin() + previous_n + max_rate, frame_nos.begin());
         }
-        similarities.clear();
-        if(step == sampleRate)
+        std::copy(batch_frame_nos, batch_frame_nos + n, frame_nos.begin() + max_rate);
+        if(normalized_calculator)
+            normalizeRows(batch_data, n, nums);
+        //第pos帧是所有整除pos的采样率上的采样帧，和该采样率上的前一个采样帧比较
+        pairs.clear();
+        pair_rates.clear();
+        for(int j = 0; j < n; ++j)
         {
-            int other = index ^ 1;
-            while(extractor.getKey(keys[other]))
+            const int row = max_rate + j;
+            for(size_t i = 0; i < sampleRates.size(); ++i)
             {
-                extractor.getRecord(features[other]);
-                for(int i = 0; i < nums; ++i)
-                    featureVectors[other][i] = features[other].float_data(i);
-                float distance = calculator->calculate(featureVectors[index],featureVectors[other],nums);
-                int frame_no = std::stoi(keys[index]);
-                similarities.push_back(std::make_pair(frame_no,distance));
-                index = other;
-                other = index ^ 1;
-                //获得下一个采样帧
-                step = 0;
-                while(step < sampleRate)
-                {
-                    extractor.next();
-                    if(!extractor.valid())
-                        break;
-                    ++step;
-                }
-                if(step < sampleRate)
-                    break;
+                int rate = sampleRates[i];
+                if(pos + j < rate || (pos + j) % rate != 0)
+                    continue;
+                pairs.push_back(std::make_pair(row - rate, row));
+                pair_rates.push_back(i);
             }
         }
-        delete featureVectors[0];
-        delete featureVectors[1];
-        
+        distances.resize(pairs.size());
+        calculator->calculate_batch(features, nums, pairs.data(), pairs.size(), nums, distances.data());
+        for(size_t k = 0; k < pairs.size(); ++k)
+            all_similarities[pair_rates[k]].push_back(std::make_pair(frame_nos[pairs[k].first], distances[k]));
+        previous_features = features;
+        previous_n = n;
+        pos += n;
+        if(n < batch_size)
+            break;
+    }
+    extractor.stopPrefetch();
+}
 
+//从内存映射的二进制特征文件中获取采样帧的特征，计算所有采样率上相邻采样帧之间的距离
+//每一帧的特征直接通过指针访问，不需要解析；距离度量在归一化的特征上有更快的算法时，
+//和db文件一样每一帧只归一化一次，两种输入得到相同的距离
+void getSimilaritiesSquenceFromFile(const string &features_file, const vector<int> &sampleRates, string type,
+    vector<vector<pair<int,float>>> &all_similarities)
+{
+    FeatureFileReader reader;
+    if(reader.open(features_file))
+    {
+        LOG(ERROR) << "cannot open the feature file " << features_file;
+        return;
+    }
+    shared_ptr<CalculateDistance<float>> calculator = CreateCalculator<float>().create(type);
+    const int nums = reader.dim();
+    const size_t num_frames = reader.numFrames();
+    //文件的第i行是第i * frameStep()帧，采样率r上比较间隔steps[k]行的帧，结果写入all_similarities[rate_indices[k]]
+    vector<size_t> steps, rate_indices;
+    for(size_t r = 0; r < sampleRates.size(); ++r)
+    {
+        if(sampleRates[r] % reader.frameStep() != 0)
+        {
+            LOG(ERROR) << "the sample rate " << sampleRates[r] << " is not a multiple of the frame step of " << features_file;
+            continue;
+        }
+        steps.push_back(sampleRates[r] / reader.frameStep());
+        rate_indices.push_back(r);
+    }
+    if(steps.empty())
+        return;
+    shared_ptr<CalculateDistance<float>> normalized_calculator = calculator->normalizedCalculator();
+    if(!normalized_calculator)
+    {
+        //所有行在映射的文件中连续存放，整个采样率上的帧对一次交给calculate_batch
+        for(size_t k = 0; k < steps.size(); ++k)
+        {
+            vector<pair<int,int>> pairs;
+            for(size_t i = 0; i + steps[k] < num_frames; i += steps[k])
+                pairs.push_back(std::make_pair(static_cast<int>(i), static_cast<int>(i + steps[k])));
+            vector<float> distances(pairs.size());
+            calculator->calculate_batch(reader.row(0), nums, pairs.data(), pairs.size(), nums, distances.data());
+            for(size_t p = 0; p < pairs.size(); ++p)
+                all_similarities[rate_indices[k]].push_back(
+                    std::make_pair(static_cast<int>(pairs[p].first * reader.frameStep()), distances[p]));
+        }
+        return;
+    }
+    //映射的特征是只读的，按块拷贝到复用的缓冲区中归一化：前max_step行是上一块的最后max_step行，之后是当前块，
+    //第i行和前一个采样帧i - step在缓冲区中相隔step行
+    const size_t max_step = *std::max_element(steps.begin(), steps.end());
+    const size_t block_size = 64;
+    vector<float> rows((max_step + block_size) * nums);
+    vector<pair<int,int>> pairs;
+    vector<size_t> pair_rates;
+    vector<float> distances;
+    for(size_t begin = 0; begin < num_frames; begin += block_size)
+    {
+        const size_t n = std::min(block_size, num_frames - begin);
+        //上一块一定是完整的block_size行，它的最后max_step行在缓冲区的第block_size行开始
+        if(begin > 0)
+            std::copy(rows.begin() + block_size * nums, rows.begin() + (block_size + max_step) * nums, rows.begin());
+        float *block = rows.data() + max_step * nums;
+        std::copy(reader.row(begin), reader.row(begin) + n * nums, block);
+        normalizeRows(block, n, nums);
+        pairs.clear();
+        pair_rates.clear();
+        for(size_t j = 0; j < n; ++j)
+        {
+            const size_t i = begin + j;
+            for(size_t k = 0; k < steps.size(); ++k)
+            {
+                if(i < steps[k] || i % steps[k] != 0)
+                    continue;
+                pairs.push_back(std::make_pair(static_cast<int>(max_step + j - steps[k]), static_cast<int>(max_step + j)));
+                pair_rates.push_back(k);
+            }
+        }
+        distances.resize(pairs.size());
+        normalized_calculator->calculate_batch(rows.data(), nums, pairs.data(), pairs.size(), nums, distances.data());
+        for(size_t p = 0; p < pairs.size(); ++p)
+        {
+            const size_t k = pair_rates[p];
+            const int frame_no = static_cast<int>((begin + pairs[p].second - max_step - steps[k]) * reader.frameStep());
+            all_similarities[rate_indices[k]].push_back(std::make_pair(frame_no, distances[p]));
+        }
     }
 }
 
@@ -97,59 +194,13 @@ void getSimilaritiesSquence(const string &features_db, const string &db_type, in
 //算法1
 //T = local_mean + a * local_sigma * (1 + ln(global_mean / local_mean))
 //当d(i) > T 或者 d(i)比其相邻的大很多时，认为该帧是candidate
+//局部统计量由FilterEngine的前缀和得到，系数a和原来的实现一样固定为0.7，sigma只被算法2使用
 vector<int> filtering(vector<pair<int,float>> &distances, float sigma, int window_size)
 {
-    float window_sum = 0.0;
-    //int start_frame = window_size - 1;
-    size_t window_start = 0;
-    size_t window_end = 2 * window_size - 2;
-    
+    const float a = 0.7;
     vector<int> candidates;
-    if(distances.empty())
-        return candidates;
-
-    //计算全局平均值
-    float global_mean = 0.0;
-    float sum = 0.0;
-    for(size_t i = 0; i < distances.size();++i)
-        sum += distances[i].second;
-    global_mean = sum / distances.size();
-    
-    int frame_no = window_start + window_size - 1;
-    for(size_t i = window_start; i <= window_end;++i)
-        window_sum += distances[i].second;
-    while(window_end < distances.size())
-    {
-        //计算local mean ,local standard deviation
-        float local_mean = window_sum / (2 * window_size -1); 
-        float local_d = 0.0;
-        for(size_t i = window_start; i < window_end;++i)
-        {
-            local_d = (distances[i].second - local_mean) * (distances[i].second - local_mean);
-
-        }
-        local_d = std::sqrt(local_d / (2 * window_size - 2));
-        //计算threshold
-        float a = 0.7;
-        float threshold = local_mean + a * local_d * (1 + std::log(global_mean / local_mean));
-        if(distances[frame_no] .second > threshold)
-            candidates.push_back(distances[frame_no].first);
-        else{
-            if((distances[frame_no].second > 3 * distances[frame_no - 1].second 
-                || distances[frame_no].second > 3 * distances[frame_no + 1].second)
-                && distances[frame_no].second > 0.8 * global_mean)
-                candidates.push_back(distances[frame_no].first);
-        }
-        //滑动窗口
-        ++frame_no;
-        window_sum -= distances[window_start].second;
-        ++window_end;
-        if(window_end < distances.size())
-            window_sum += distances[window_end].second;
-
-    }
+    FilterEngine(distances).filter(FilterParam::adaptive(a, window_size), candidates);
     return candidates;
-    
 }
 
 //candidate seletction
@@ -158,52 +209,9 @@ vector<int> filtering(vector<pair<int,float>> &distances, float sigma, int windo
 //当d(i) > T认为该帧是candidate
 vector<int> filtering2(vector<pair<int,float>> &distances, float sigma, float static_th,int window_size)
 {
-    float window_sum = 0.0;
-    //int start_frame = window_size - 1;
-    size_t window_start = 0;
-    size_t window_end = 2 * window_size - 2;
-    
     vector<int> candidates;
-    if(distances.empty())
-        return candidates;
-
-    //计算全局平均值
-    float global_mean = 0.0;
-    float sum = 0.0;
-    for(size_t i = 0; i < distances.size();++i)
-        sum += distances[i].second;
-    global_mean = sum / distances.size();
-    
-    int frame_no = window_start + window_size - 1;
-    for(size_t i = window_start; i <= window_end;++i)
-        window_sum += distances[i].second;
-    while(window_end < distances.size())
-    {
-        //计算local mean ,local standard deviation
-        float local_mean = window_sum / (2 * window_size -1); 
-        // float local_d = 0.0;
-        // for(size_t i = window_start; i < window_end;++i)
-        // {
-        //     local_d = (distances[i].second - local_mean) * (distances[i].second - local_mean);
-
-        // }
-        // local_d = std::sqrt(local_d / (2 * window_size - 2));
-        //计算threshold
-        
-        float threshold = static_th + sigma * local_mean;
-        if(distances[frame_no] .second > threshold)
-            candidates.push_back(distances[frame_no].first);
-        
-        //滑动窗口
-        ++frame_no;
-        window_sum -= distances[window_start].second;
-        ++window_end;
-        if(window_end < distances.size())
-            window_sum += distances[window_end].second;
-
-    }
+    FilterEngine(distances).filter(FilterParam::fixed(sigma, static_th, window_size), candidates);
     return candidates;
-    
 }
 
 int main(int argc, char **argv)
@@ -214,11 +222,12 @@ int main(int argc, char **argv)
     {
         LOG(ERROR) << 
         "This program is used to calculate  frame distances\n"
-        "Usage:FeaturesAndDistance features_db db_type sampleRates type\n"
+        "Usage:FeaturesAndDistance features_db db_type sampleRates type [filter]\n"
         "features_db:包含单个视频中所有帧图像的特征的db文件\n"
-        "db_type: db文件的类型 leveldb, lmdb\n"
+        "db_type: db文件的类型 leveldb, lmdb, binary\n"
         "sampleRate: 采样率,用逗号隔开的采样率序列\n"
-        "type: 距离度量的类型，目前有Cosine\n";
+        "type: 距离度量的类型，目前有Cosine, L2, L1, ChiSquare, HistIntersection, Hamming\n"
+        "filter: 可选，candidate的过滤算法，adaptive(算法1，默认)或static(算法2)\n";
         return 1;
     }
     int arg_pos = 0;
@@ -231,26 +240,20 @@ int main(int argc, char **argv)
     for(size_t i = 0; i < temp.size();++i)
         sampleRates.push_back(std::stoi(temp[i]));
     string distance_type(argv[++arg_pos]);
-    vector<vector<pair<int,float>>> all_distances(sampleRates.size());
-
-    for(size_t i = 0; i < sampleRates.size();++i)
+    if(!CreateCalculator<float>().create(distance_type))
+    {
+        LOG(ERROR) << "unknown distance type " << distance_type;
+        return 1;
+    }
+    FilterParam::Formula formula = FilterParam::kAdaptive;
+    if(argc > num_required_args && !FilterParam::formulaFromName(argv[++arg_pos], formula))
     {
-        getSimilaritiesSquence(features_db,db_type,sampleRates[i],distance_type,all_distances[i]);
-        // string output_file("distance");
-        // output_file = output_file + std::to_string(i);
-        // std::ofstream out(output_file);
-        // if(!out.is_open())
-        // {
-        //     LOG(ERROR) << "cannot create the file " << output_file;
-        //     return 1;
-        // }
-        // for(size_t j = 0; j < all_distances[i].size();++j)
-        // {
-        //     out << std::setw(10) << std::setfill('0') << all_distances[i][j].first << " " << all_distances[i][j].second
-        //         << std::endl;
-        // }
-        // out.close();
+        LOG(ERROR) << "unknown filter " << argv[arg_pos];
+        return 1;
     }
+    vector<vector<pair<int,float>>> all_distances;
+
+    getSimilaritiesSquence(features_db,db_type,sampleRates,distance_type,all_distances);
     vector<vector<int>> initial_candidates;
     //float t = 0.5;
     float sigma = 0.5;
@@ -259,7 +262,8 @@ int main(int argc, char **argv)
     //进行初步的筛选
     for(size_t i = 0; i < sampleRates.size();++i)
     {
-        vector<int> temp = filtering(all_distances[i], sigma, window_size);
+        vector<int> temp = formula == FilterParam::kAdaptive ? filtering(all_distances[i], sigma, window_size)
+            : filtering2(all_distances[i], sigma, static_th, window_size);
         //打印以供调试
         string candidate_file_name("candidates_at_sample_");
         candidate_file_name.append(std::to_string(sampleRates[i]));
@@ -273,7 +277,8 @@ int main(int argc, char **argv)
         initial_candidates.push_back(temp);
 
     }
-    vector<int> all = merger_candidates(initial_candidates);
+    vector<int> all;
+    mergeCandidates(initial_candidates, 5, all);
     string output_file_name(features_db);
     output_file_name.append("_candidates");
     std::ofstream all_file(output_file_name);
@@ -286,47 +291,3 @@ int main(int argc, char **argv)
 
     return 0;
 }
-
-//合并不同采样率得到的candidate
-vector<int> merger_candidates(vector<vector<int>> &candidates_at_all_sampleRates)
-{
-    //测试，简单的合并所有的结果
-    vector<int> result;
-    if(candidates_at_all_sampleRates.empty())
-        return result;
-    std::list<int> temp(candidates_at_all_sampleRates[0].begin(),candidates_at_all_sampleRates[0].end());
-    const int min_space = 5;    //不同采样率之间的候选帧之间的最小间隔
-    for(size_t i = 1; i < candidates_at_all_sampleRates.size();++i)
-    {
-        auto it = temp.begin();
-        auto prev_it = temp.end();
-        for(size_t j = 0; j < candidates_at_all_sampleRates[i].size();++j)
-        {
-            while(it != temp.end() && *it < candidates_at_all_sampleRates[i][j])
-            {
-                prev_it = it;
-                ++it;
-            }
-           
-            //如果不同采样率的candidates相隔太近，则只保留低采样率的candidates
-            if(it == temp.begin())
-            {
-                if(*it >= candidates_at_all_sampleRates[i][j] + min_space)
-                    temp.insert(it, candidates_at_all_sampleRates[i][j]);
-            }else if(it == temp.end())
-            {
-                if(candidates_at_all_sampleRates[i][j] >= *prev_it + min_space)
-                    temp.insert(it, candidates_at_all_sampleRates[i][j]);
-            }else
-            {
-                if(*it >= candidates_at_all_sampleRates[i][j] + min_space 
-                    && candidates_at_all_sampleRates[i][j] >= *prev_it + min_space)
-                    temp.insert(it, candidates_at_all_sampleRates[i][j]);
-            }
-            
-        }
-    }
-    result.resize(temp.size());
-    std::copy(temp.begin(),temp.end(),result.begin());
-    return result;
-}
\ No newline at end of file
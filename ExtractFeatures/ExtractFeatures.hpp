@@ -3,6 +3,8 @@
 
 #include <cstring>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include "boost/algorithm/string.hpp"
 #include "google/protobuf/text_format.h"
@@ -15,6 +17,8 @@
 #include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
 
+#include "FeatureFile.hpp"
+
 using caffe::Caffe;
 using caffe::Net;
 using caffe::Blob;
@@ -39,6 +43,7 @@ int feature_extract(int argc, char** argv);
 *                              extract_feature_blob_name save_feature_file_name  num_mini_batches
 *                              leveldb/lmdb [CPU/GPU]  [device_id]
 *  输出特征文件save_feature_file_name的每一个record对应单个样本的特征，其key是图像的索引（用10位数字表示），其value是对应输出blob的Datum对象
+*  db类型为binary时输出FeatureFile.hpp格式的二进制特征文件，第i行为第i个样本的特征
 *  包含可执行文件名字在内的所有命令行参数至少有7个
 */
 template<typename Dtype> 
@@ -51,6 +56,57 @@ int feature_extract_to_db(const string &pretrained_net_param, const string &feat
 // int feature_extract_to_db_float(const string &pretrained_net_param, const string &feature_extraction_proto_file, const string &extract_feature_blob_names,
 //      const string &save_feature_file_names, const int num_mini_batches,const int num_of_frames, const string &db_backend, const string mode = "CPU", const int device_id = 0);
 
+//将网络中blob_names对应的特征写入二进制特征文件file_names，每个样本的特征连续存放，不经过Datum的序列化
+template<typename Dtype>
+int feature_extract_to_file(const boost::shared_ptr<Net<Dtype> > &feature_extraction_net, const std::vector<std::string> &blob_names,
+    const std::vector<std::string> &file_names, const int num_mini_batches, const int num_of_frames)
+{
+    size_t num_features = blob_names.size();
+    std::vector<boost::shared_ptr<FeatureFileWriter> > writers;
+    for (size_t i = 0; i < num_features; ++i) {
+        LOG(INFO)<< "Opening feature file " << file_names[i];
+        const boost::shared_ptr<Blob<Dtype> > feature_blob =
+            feature_extraction_net->blob_by_name(blob_names[i]);
+        boost::shared_ptr<FeatureFileWriter> writer(new FeatureFileWriter());
+        if(writer->open(file_names[i], feature_blob->count() / feature_blob->num()))
+        {
+            LOG(ERROR) << "cannot create the file " << file_names[i];
+            return 1;
+        }
+        writers.push_back(writer);
+    }
+    LOG(ERROR)<< "Extracting Features";
+    std::vector<float> rows;
+    for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
+        feature_extraction_net->Forward();
+        for (size_t i = 0; i < num_features; ++i) {
+            const boost::shared_ptr<Blob<Dtype> > feature_blob =
+                feature_extraction_net->blob_by_name(blob_names[i]);
+            int batch_size = feature_blob->num();
+            int dim_features = feature_blob->count() / batch_size;
+            //最后一个batch中可能有不属于视频的样本
+            int num_rows = std::min<int>(batch_size, num_of_frames - writers[i]->numFrames());
+            if(num_rows <= 0)
+                continue;
+            const Dtype *feature_blob_data = feature_blob->cpu_data();
+            rows.assign(feature_blob_data, feature_blob_data + num_rows * dim_features);
+            writers[i]->append(rows.data(), num_rows);
+        }
+    }
+    for (size_t i = 0; i < num_features; ++i) {
+        LOG(ERROR)<< "Extracted features of " << writers[i]->numFrames() <<
+            " query images for feature blob " << blob_names[i];
+        if(writers[i]->close())
+        {
+            LOG(ERROR) << "cannot write the file " << file_names[i];
+            return 1;
+        }
+    }
+
+    LOG(ERROR)<< "Successfully extracted the features!";
+    return 0;
+}
+
 template<typename Dtype>
 int feature_extract_to_db(const string &pretrained_net_param, const string &feature_extraction_proto_file, const string &extract_feature_blob_names,
     const string &save_feature_file_names, const int num_mini_batches, const int num_of_frames,const string &db_backend, const string mode, const int device_id)
@@ -86,6 +142,9 @@ int feature_extract_to_db(const string &pretrained_net_param, const string &feat
             << " in the network " << feature_extraction_proto_file;
     }
 
+    if(db_backend == "binary")
+        return feature_extract_to_file<Dtype>(feature_extraction_net, blob_names, dataset_names, num_mini_batches, num_of_frames);
+
     std::vector<boost::shared_ptr<db::DB> > feature_dbs;
     std::vector<boost::shared_ptr<db::Transaction> > txns;
 
@@ -165,7 +224,7 @@ int feature_extract_to_db(int argc, char** argv)
         " extract features of the input data produced by the net.\n"
         "usage: ExtractFeature pretrained_net_param feature_extraction_proto_file"
         " extract_feature_blob_name save_feature_file_name num_mini_batches"
-        " [leveldb/lmdb] [CPU/GPU]  [device_id]\n"
+        " [leveldb/lmdb/binary] [CPU/GPU]  [device_id]\n"
         "Note: you can extract multiple features in one pass by specifying"
         " multiple feature blob names and dataset names separated by ','."
         " The names cannot contain white space characters and the number of blobs"
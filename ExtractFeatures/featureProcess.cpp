@@ -44,7 +44,7 @@ int processAllVideos(int argc, char **argv)
         "net_protofile:网络的proto txt文件\n"
         "blob_names :要提取的特征对应的blob的名字,用逗号隔开\n"
         "video_file_list:包含所有视频文件路径的文本文件\n"
-        "db_backend:leveldb还是lmdb\n"
+        "db_backend:leveldb、lmdb或binary，binary时特征保存为二进制特征文件(视频名_blob名.feat)，解码的帧仍暂存在lmdb中\n"
         "batch_size:提取特征时使用的batch的大小\n"
         "new_height:缩放后的图像高度\n"
         "new_width:缩放后的图像宽度\n";
@@ -104,8 +104,10 @@ int extractFeaturesForVideo(const string &video_file, const string &pretrained_b
         file_name.push_back('_');
         file_name.append(blob_names[i]);
         file_names.append(file_name);
-        file_names.append(db_backend);
+        file_names.append(db_backend == "binary" ? ".feat" : db_backend);
     }
+    //数据层只能从leveldb或lmdb中读取帧图像
+    const string frame_db_backend = db_backend == "binary" ? "lmdb" : db_backend;
     
     cv::VideoCapture cap;
     cv::Mat img, img_origin;
@@ -124,7 +126,7 @@ int extractFeaturesForVideo(const string &video_file, const string &pretrained_b
     int frame_no = 0;
     Datum datum;
     
-    boost::shared_ptr<db::DB> videoDB(db::GetDB(db_backend));
+    boost::shared_ptr<db::DB> videoDB(db::GetDB(frame_db_backend));
     string db_name(video_file);
     db_name.append("_ImageDb");
     videoDB->Open(db_name,db::NEW);
@@ -184,7 +186,7 @@ int extractFeaturesForVideo(const string &video_file, const string &pretrained_b
         {
             caffe::DataParameter *data_param = net_param.mutable_layer(i)->mutable_data_param();
             data_param->set_source(db_name);
-            if(db_backend == "leveldb")
+            if(frame_db_backend == "leveldb")
                 data_param->set_backend(caffe::DataParameter_DB_LEVELDB);
             else
                 data_param->set_backend(caffe::DataParameter_DB_LMDB);
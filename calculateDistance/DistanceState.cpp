@@ -0,0 +1,140 @@
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "DistanceState.hpp"
+
+DistanceState::DistanceState(const string &distance_type, const vector<int> &all_rates, const vector<int> &dim_features)
+    :m_rates(all_rates),m_dim_features(dim_features),m_frame_step(0),m_end_frame(INT_MAX)
+{
+    //计算所有采样率的最大公约数
+    for(size_t i = 0; i < all_rates.size(); ++i)
+    {
+        int a = m_frame_step, b = all_rates[i];
+        while(b != 0)
+        {
+            int t = a % b;
+            a = b;
+            b = t;
+        }
+        m_frame_step = a;
+    }
+    m_calculator = CreateCalculator<float>().create(distance_type);
+    CHECK(m_calculator) << "Unknown distance type " << distance_type;
+    //距离度量在归一化的特征上有更快的算法时(如Cosine只需要一次点积)，每一帧的特征只归一化一次，
+    //被所有采样率以及之后和它比较的batch复用(m_history中保存的也是归一化的特征)
+    shared_ptr<CalculateDistance<float>> normalized_calculator = m_calculator->normalizedCalculator();
+    m_normalize = static_cast<bool>(normalized_calculator);
+    if(m_normalize)
+        m_calculator = normalized_calculator;
+    size_t num_features = dim_features.size();
+    m_to_compare.assign(num_features, vector<int>(all_rates.size(), 0));
+    int max_rate = *std::max_element(all_rates.begin(), all_rates.end());
+    for(size_t i = 0; i < num_features; ++i)
+        m_history.push_back(FeatureRing(max_rate / m_frame_step, dim_features[i]));
+    m_normalized.resize(num_features);
+    m_all_distances.assign(num_features, vector<vector<pair<int,float>>>(all_rates.size()));
+}
+
+void DistanceState::reset(int begin_frame, int end_frame)
+{
+    m_end_frame = end_frame;
+    for(size_t i = 0; i < m_dim_features.size(); ++i)
+    {
+        for(size_t j = 0; j < m_rates.size(); ++j)
+        {
+            //只比较序号为采样率整数倍的帧，从不小于begin_frame的第一个这样的帧开始
+            m_to_compare[i][j] = (begin_frame + m_rates[j] - 1) / m_rates[j] * m_rates[j];
+            m_all_distances[i][j].clear();
+        }
+        m_history[i].reset();
+    }
+}
+
+void DistanceState::append(const DistanceState &other)
+{
+    for(size_t i = 0; i < m_dim_features.size(); ++i)
+    {
+        for(size_t j = 0; j < m_rates.size(); ++j)
+            m_all_distances[i][j].insert(m_all_distances[i][j].end(),
+                other.m_all_distances[i][j].begin(), other.m_all_distances[i][j].end());
+    }
+}
+
+const vector<pair<int,float>>& DistanceState::distances(size_t feature_index, size_t rate_index) const
+{
+    return m_all_distances[feature_index][rate_index];
+}
+
+//计算一批帧上不同特征在不同采样率上的距离
+//batch中只包含序号为m_frame_step整数倍的帧，第k个元素对应第window_begin + k * m_frame_step帧
+//m_to_compare和m_history保存了跨batch比较所需的状态
+void DistanceState::update(const FeatureBatch &batch)
+{
+    int window_begin = batch.frame_nos.front();
+    int window_end = batch.frame_nos.back() + 1;
+    for(size_t feature_index = 0; feature_index < batch.features.size();++feature_index)
+    {
+        int dim = m_dim_features[feature_index];  //特征的维度
+        const float *feature_blob_data = batch.features[feature_index].data();  //所有图像的特征数据
+        if(m_normalize)
+        {
+            //归一化到复用的缓冲区中，不修改batch，特征缓存中保存的仍然是原始特征
+            vector<float> &normalized = m_normalized[feature_index];
+            normalized.assign(feature_blob_data, feature_blob_data + batch.frame_nos.size() * dim);
+            normalizeRows(normalized.data(), batch.frame_nos.size(), dim);
+            feature_blob_data = normalized.data();
+        }
+        //先收集所有采样率上要比较的帧对，batch内的帧对通过一次calculate_batch计算，
+        //和上一个batch中的帧比较的帧对(每个采样率最多一对)单独计算
+        m_pairs.clear();
+        m_pair_begin.resize(m_rates.size() + 1);
+        m_cross_distances.assign(m_rates.size(), std::make_pair(-1, 0.0f));
+        int first_needed = INT_MAX;     //各采样率上下一次比较的第一帧中最早的一帧
+        for(size_t rate_index = 0; rate_index < m_rates.size(); ++rate_index )
+        {
+            int &to_compare = m_to_compare[feature_index][rate_index];
+            const int rate = m_rates[rate_index];
+            m_pair_begin[rate_index] = m_pairs.size();
+            while(to_compare + rate < window_end && to_compare < m_end_frame)
+            {
+                int frame1_no = to_compare;
+                int row2 = (frame1_no + rate - window_begin) / m_frame_step;
+                if(frame1_no >= window_begin)
+                    m_pairs.push_back(std::make_pair((frame1_no - window_begin) / m_frame_step, row2));
+                else
+                    m_cross_distances[rate_index] = std::make_pair(frame1_no, m_calculator->calculate(
+                        m_history[feature_index].row(frame1_no / m_frame_step), feature_blob_data + row2 * dim, dim));
+                to_compare += rate;
+            }
+            if(to_compare < m_end_frame)
+                first_needed = std::min(first_needed, to_compare);
+        }
+        //之后的batch还要和本batch中不早于first_needed的帧比较，把这些帧放入环形缓冲区
+        //每个采样率上first_needed之后最多有rate / m_frame_step帧，不会超过缓冲区的容量
+        first_needed = std::max(first_needed, window_begin);
+        if(first_needed < window_end)
+            m_history[feature_index].push(first_needed / m_frame_step,
+                feature_blob_data + (first_needed - window_begin) / m_frame_step * dim, (window_end - 1 - first_needed) / m_frame_step + 1);
+        m_pair_begin[m_rates.size()] = m_pairs.size();
+        m_pair_distances.resize(m_pairs.size());
+        m_calculator->calculate_batch(feature_blob_data, dim, m_pairs.data(), m_pairs.size(), dim, m_pair_distances.data());
+        //按采样率的顺序输出，每个采样率上的距离按帧序号递增
+        for(size_t rate_index = 0; rate_index < m_rates.size(); ++rate_index)
+        {
+            if(m_cross_distances[rate_index].first >= 0)
+                emitDistance(feature_index, rate_index, m_cross_distances[rate_index].first, m_cross_distances[rate_index].second);
+            for(size_t k = m_pair_begin[rate_index]; k < m_pair_begin[rate_index + 1]; ++k)
+                emitDistance(feature_index, rate_index, window_begin + m_pairs[k].first * m_frame_step, m_pair_distances[k]);
+        }
+    }//完成不同特征在不同采样率上的距离计算
+}
+
+//保存距离，或者在流式处理时交给对应的detector
+void DistanceState::emitDistance(size_t feature_index, size_t rate_index, int frame_no, float distance)
+{
+    if(m_detectors.empty())
+        m_all_distances[feature_index][rate_index].push_back(std::make_pair(frame_no,distance));
+    else
+        m_detectors[feature_index]->pushDistance(rate_index, frame_no, distance);
+}
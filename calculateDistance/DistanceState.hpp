@@ -0,0 +1,73 @@
+/*
+**保存单个视频在计算距离序列过程中的状态*
+**同一个对象可以被多个视频复用，处理新视频前调用reset()即可*
+*/
+#ifndef DISTANCESTATE_HPP_
+#define DISTANCESTATE_HPP_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <climits>
+
+#include "CalculateDistance.hpp"
+#include "StreamingDetector.hpp"
+#include "FeatureRing.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::shared_ptr;
+
+//一批视频帧的特征，features[i]为第i个特征blob的数据
+struct FeatureBatch{
+    vector<vector<float>> features;
+    vector<int> frame_nos;  //各帧在视频中的序号
+};
+
+//根据每批帧的特征，增量地计算不同特征在不同采样率上的距离序列
+class DistanceState{
+public:
+    //distance_type: 距离度量的类型
+    //all_rates: 递增的采样率序列
+    //dim_features: 各个特征的维度
+    DistanceState(const string &distance_type, const vector<int> &all_rates, const vector<int> &dim_features);
+    ~DistanceState(){}
+    //开始处理新视频(或视频中的一段)之前清空状态，保留已分配的内存
+    //只计算第一帧的序号在[begin_frame, end_frame)中的帧对的距离
+    void reset(int begin_frame = 0, int end_frame = INT_MAX);
+    void update(const FeatureBatch &batch); //计算一批帧上的距离，batch中相邻两帧的序号相差frameStep()
+    void append(const DistanceState &other);    //将other中的距离序列拼接到当前距离序列的后面
+    //流式处理：设置之后计算得到的距离不再保存，而是直接交给第i个特征对应的detectors[i]，传入空数组则恢复保存
+    void setDetectors(const vector<StreamingDetector*> &detectors) {m_detectors = detectors;}
+    //第feature_index个特征在第rate_index个采样率上的距离序列，每一项为(帧序号，距离)
+    const vector<pair<int,float>>& distances(size_t feature_index, size_t rate_index) const;
+    size_t numFeatures() const {return m_dim_features.size();}
+    const vector<int>& rates() const {return m_rates;}
+    //只有序号为frameStep()整数倍的帧才会参与比较(所有采样率的最大公约数)，其余帧不需要提取特征
+    int frameStep() const {return m_frame_step;}
+private:
+    void emitDistance(size_t feature_index, size_t rate_index, int frame_no, float distance);
+
+    shared_ptr<CalculateDistance<float>> m_calculator;
+    vector<int> m_rates;
+    vector<int> m_dim_features;
+    int m_frame_step;
+    bool m_normalize;   //是否在计算距离前把特征归一化，此时m_calculator为归一化特征上的版本
+    vector<vector<float>> m_normalized;  //m_normalized[i]为当前batch中第i个特征归一化后的数据
+    int m_end_frame;
+    vector<vector<int>> m_to_compare;    //m_to_compare[i][j]第i特征在采样率j上要计算的帧的序号,初始均从0开始
+    //第i个特征最近max_rate / m_frame_step个采样帧的特征，所有采样率共用，第k行为第k * m_frame_step帧
+    vector<FeatureRing> m_history;
+    //m_all_distances[i]表示第i个特征的距离序列集合
+    //m_all_distances[i][j]表示第i个特征在采样率j上的距离序列
+    vector<vector<vector<pair<int,float>>>> m_all_distances;
+    vector<StreamingDetector*> m_detectors;
+    //update()中一个特征在当前batch内要比较的帧对(batch中的行号)，第j个采样率的帧对为[m_pair_begin[j], m_pair_begin[j+1])
+    vector<pair<int,int>> m_pairs;
+    vector<size_t> m_pair_begin;
+    vector<float> m_pair_distances;
+    vector<pair<int,float>> m_cross_distances;    //和上一个batch中的帧比较得到的(帧序号，距离)，没有时帧序号为-1
+};
+#endif
@@ -0,0 +1,600 @@
+/*
+**端到端的吞吐量测试*
+**生成一组镜头边界已知的合成视频(不同的长度、硬切位置和360p到1080p的分辨率)，在一个calculateDistance进程中处理所有视频，*
+**每个视频的耗时、帧率和batch延迟取自calculateDistance --report的输出，不包含进程启动和加载网络的时间，*
+**同时记录整个进程的耗时和峰值内存，并把输出的candidate和已知的硬切比较得到召回率*
+**结果以JSON输出，可以和之前保存的结果比较，帧率、耗时、内存或召回率变差超过阈值时返回1*
+**指定--check_segments时再用--segments分段处理同样的视频，分段和顺序处理得到的candidate不同时返回1*
+*/
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+#include "boost/algorithm/string.hpp"
+#include "boost/filesystem.hpp"
+
+#include "SyntheticVideo.hpp"
+#include "Options.hpp"
+#include "Json.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+
+//合成视频的分辨率，依次循环使用
+const int kResolutions[][2] = {{640, 360}, {854, 480}, {1280, 720}, {1920, 1080}};
+const int kNumResolutions = sizeof(kResolutions) / sizeof(kResolutions[0]);
+//镜头的最短长度，保证相邻的硬切不会被合并成一个candidate
+const int kMinShotLength = 20;
+
+struct CorpusVideo{
+    string file;
+    int width, height;
+    int num_frames;
+    vector<int> cuts;       //第cuts[k]帧是新镜头的第一帧
+};
+
+struct VideoResult{
+    const CorpusVideo *video;
+    double latency;         //calculateDistance处理该视频的秒数，不包含进程启动和加载网络
+    double fps;             //解码的帧数 / latency
+    double batch_latency_p90;   //一个batch从开始解码到距离计算完成的时间的p90
+    int num_candidates;
+    int hits;               //被candidate命中的硬切个数
+};
+
+struct Summary{
+    double seconds;         //calculateDistance进程的总耗时，包含一次启动和加载网络
+    double fps;             //所有视频的总帧数 / seconds，使用--workers时反映并行处理的吞吐量
+    double latency_mean;
+    double latency_p50;
+    double latency_p90;
+    long peak_rss_kb;       //calculateDistance进程的峰值常驻内存
+    double recall;
+    double precision;
+};
+
+int prepareCorpus(const string &corpus_dir, int num_videos, int min_frames, int max_frames, unsigned seed,
+    vector<CorpusVideo> &corpus);
+int runCalculateDistance(const vector<string> &args, const string &log_file, double &latency, long &peak_rss_kb);
+int readReport(const string &report_file, VideoResult &result);
+int matchCuts(const string &candidates_file, const vector<int> &cuts, int tolerance, int &num_candidates, int &hits);
+void summarize(const vector<VideoResult> &results, double seconds, long peak_rss_kb, Summary &summary);
+void writeJson(std::ostream &out, const vector<string> &command, const vector<VideoResult> &results, const Summary &summary);
+int checkSegments(const vector<string> &command, const vector<CorpusVideo> &corpus, const vector<string> &blob_names,
+    int num_segments, const string &output_dir, const string &segments_dir);
+int loadBaseline(const string &baseline_file, Summary &baseline);
+int compareWithBaseline(const Summary &summary, const Summary &baseline, double max_regression);
+
+int main(int argc, char **argv)
+{
+    ::google::InitGoogleLogging(argv[0]);
+    int num_videos = std::stoi(takeOption(argc, argv, "--videos", "8"));
+    int min_frames = std::stoi(takeOption(argc, argv, "--min_frames", "300"));
+    int max_frames = std::stoi(takeOption(argc, argv, "--max_frames", "1500"));
+    unsigned seed = std::stoul(takeOption(argc, argv, "--seed", "2018"));
+    string extra_args = takeOption(argc, argv, "--args", "");
+    int tolerance = std::stoi(takeOption(argc, argv, "--tolerance", "-1"));
+    string baseline_file = takeOption(argc, argv, "--baseline", "");
+    double max_regression = std::stod(takeOption(argc, argv, "--max_regression", "0.1"));
+    string output_file = takeOption(argc, argv, "--output", "");
+    int check_segments = std::stoi(takeOption(argc, argv, "--check_segments", "0"));
+    const int num_required_args = 10;
+    if(argc != num_required_args || num_videos < 1 || min_frames < 2 * kMinShotLength || max_frames < min_frames
+        || check_segments < 0)
+    {
+        LOG(ERROR) <<
+        "This program is used to benchmark calculateDistance end to end on synthetic videos with known cuts\n"
+        "用法：e2eBench [--videos N] [--min_frames N] [--max_frames N] [--seed S] [--args \"options\"] [--tolerance N] [--baseline file] [--max_regression r] [--output file] [--check_segments N] "
+        "calculateDistance pretained_net_param net_protofile blob_names new_height new_width distance_type sampleRates work_dir\n"
+        "calculateDistance:要测试的calculateDistance可执行文件\n"
+        "pretained_net_param net_protofile blob_names new_height new_width distance_type sampleRates:传给calculateDistance的参数，召回率用第一个特征计算\n"
+        "work_dir:工作目录，合成视频保存在work_dir/corpus中并在之后的运行中复用，calculateDistance的输出和日志在work_dir/output中\n"
+        "所有视频写入同一个列表，由一个calculateDistance进程加上--report处理，每个视频的耗时取自其输出的report\n"
+        "--videos N:合成视频的个数，默认为8，分辨率在640x360、854x480、1280x720、1920x1080之间循环\n"
+        "--min_frames N --max_frames N:每个视频的帧数在[min_frames, max_frames]中随机选取，默认为300和1500\n"
+        "--seed S:生成视频长度、硬切位置和内容的随机种子，默认为2018\n"
+        "--args \"options\":额外传给calculateDistance的可选参数，如\"--workers 4\"同时处理4个视频，总帧率随之变化\n"
+        "--tolerance N:candidate距离硬切不超过N帧时算作命中，默认为最大的采样率\n"
+        "--baseline file:之前保存的结果，总帧率、每个视频的平均耗时、p90耗时或峰值内存变差超过max_regression，或者召回率下降超过0.01时返回1\n"
+        "--max_regression r:允许的相对变化，默认为0.1\n"
+        "--output file:JSON结果写入file，默认输出到标准输出\n"
+        "--check_segments N:再用--segments N处理同样的视频，输出在work_dir/segments中，每个特征的candidate和顺序处理的结果不同时返回1\n";
+        return 1;
+    }
+    int arg_pos = 0;
+    string binary(argv[++arg_pos]);
+    vector<string> network_args(argv + arg_pos + 1, argv + arg_pos + 8);
+    arg_pos += 7;
+    string work_dir(argv[++arg_pos]);
+    if(work_dir.back() != '/')
+        work_dir.push_back('/');
+    string blob_name = network_args[2].substr(0, network_args[2].find(','));
+    if(tolerance < 0)
+    {
+        vector<string> rates;
+        boost::split(rates, network_args[6], boost::is_any_of(","));
+        tolerance = 0;
+        for(const string &rate : rates)
+            tolerance = std::max(tolerance, std::stoi(rate));
+    }
+
+    vector<CorpusVideo> corpus;
+    if(prepareCorpus(work_dir + "corpus/", num_videos, min_frames, max_frames, seed, corpus))
+        return 1;
+    string output_dir = work_dir + "output/";
+    boost::filesystem::create_directories(output_dir);
+    //所有视频放在同一个列表中，只启动一次calculateDistance，--workers等参数对整个语料生效
+    string list_file = output_dir + "videos";
+    std::ofstream list(list_file);
+    if(!list.is_open())
+    {
+        LOG(ERROR) << "cannot create the file " << list_file;
+        return 1;
+    }
+    for(const CorpusVideo &video : corpus)
+    {
+        list << video.file << std::endl;
+        //calculateDistance处理某个视频失败时不会退出，删除之前的report，避免读到上一次运行的结果
+        boost::filesystem::remove(output_dir + blob_name + "/" + video.file.substr(video.file.rfind('/') + 1) + "_report.json");
+    }
+    list.close();
+
+    vector<string> options;
+    if(!extra_args.empty())
+        boost::split(options, extra_args, boost::is_any_of(" "), boost::token_compress_on);
+    if(std::find(options.begin(), options.end(), "--report") == options.end())
+        options.push_back("--report");
+    vector<string> command(1, binary);
+    command.insert(command.end(), options.begin(), options.end());
+    command.insert(command.end(), network_args.begin(), network_args.begin() + 3);
+    command.push_back(list_file);
+    command.insert(command.end(), network_args.begin() + 3, network_args.end());
+    command.push_back(output_dir);
+    double seconds = 0;
+    long peak_rss_kb = 0;
+    if(runCalculateDistance(command, output_dir + "calculateDistance.log", seconds, peak_rss_kb))
+        return 1;
+    vector<VideoResult> results;
+    for(const CorpusVideo &video : corpus)
+    {
+        string video_name = video.file.substr(video.file.rfind('/') + 1);
+        string prefix = output_dir + blob_name + "/" + video_name;
+        VideoResult result;
+        result.video = &video;
+        if(readReport(prefix + "_report.json", result)
+            || matchCuts(prefix + "_candidates", video.cuts, tolerance, result.num_candidates, result.hits))
+            return 1;
+        LOG(INFO) << video_name << ": " << result.fps << " fps, recall "
+            << (video.cuts.empty() ? 1.0 : static_cast<double>(result.hits) / video.cuts.size());
+        results.push_back(result);
+    }
+    Summary summary;
+    summarize(results, seconds, peak_rss_kb, summary);
+    if(output_file.empty())
+        writeJson(std::cout, command, results, summary);
+    else
+    {
+        std::ofstream output(output_file);
+        if(!output.is_open())
+        {
+            LOG(ERROR) << "cannot create the file " << output_file;
+            return 1;
+        }
+        writeJson(output, command, results, summary);
+    }
+    int failed = 0;
+    if(check_segments > 0)
+    {
+        vector<string> blob_names;
+        boost::split(blob_names, network_args[2], boost::is_any_of(","));
+        failed = checkSegments(command, corpus, blob_names, check_segments, output_dir, work_dir + "segments/");
+    }
+    if(baseline_file.empty())
+        return failed;
+    Summary baseline;
+    if(loadBaseline(baseline_file, baseline))
+        return 1;
+    return compareWithBaseline(summary, baseline, max_regression) || failed;
+}
+
+//由seed确定每个视频的长度和硬切位置，视频文件名包含seed和编号，已经存在的视频不再重新生成
+//成功返回0，失败返回1
+int prepareCorpus(const string &corpus_dir, int num_videos, int min_frames, int max_frames, unsigned seed,
+    vector<CorpusVideo> &corpus)
+{
+    boost::filesystem::create_directories(corpus_dir);
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> length(min_frames, max_frames);
+    std::uniform_int_distribution<int> shot(kMinShotLength, 8 * kMinShotLength);
+    corpus.clear();
+    for(int i = 0; i < num_videos; ++i)
+    {
+        CorpusVideo video;
+        video.width = kResolutions[i % kNumResolutions][0];
+        video.height = kResolutions[i % kNumResolutions][1];
+        video.num_frames = length(rng);
+        for(int cut = shot(rng); cut + kMinShotLength <= video.num_frames; cut += shot(rng))
+            video.cuts.push_back(cut);
+        video.file = corpus_dir + "synthetic_" + std::to_string(seed) + "_" + std::to_string(i) + "_"
+            + std::to_string(video.width) + "x" + std::to_string(video.height) + ".avi";
+        if(!boost::filesystem::exists(video.file))
+        {
+            LOG(INFO) << "generating " << video.file;
+            //先写入临时文件，中断时不会留下不完整的视频
+            string temp_file = video.file + ".tmp.avi";
+            if(writeSyntheticVideo(temp_file, video.num_frames, video.height, video.width, video.cuts, seed + i))
+                return 1;
+            boost::filesystem::rename(temp_file, video.file);
+        }
+        //和sweepFilter的标注格式相同，每行为硬切前后的两帧
+        string transitions_file = corpus_dir + video.file.substr(video.file.rfind('/') + 1) + "_transitions";
+        std::ofstream transitions(transitions_file);
+        if(!transitions.is_open())
+        {
+            LOG(ERROR) << "cannot create the file " << transitions_file;
+            return 1;
+        }
+        for(int cut : video.cuts)
+            transitions << cut - 1 << " " << cut << std::endl;
+        corpus.push_back(video);
+    }
+    return 0;
+}
+
+//在子进程中运行args，标准输出和标准错误写入log_file，返回耗时和子进程的峰值常驻内存
+//成功返回0，失败返回1
+int runCalculateDistance(const vector<string> &args, const string &log_file, double &latency, long &peak_rss_kb)
+{
+    vector<char*> argv;
+    for(const string &arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        LOG(ERROR) << "cannot fork: " << std::strerror(errno);
+        return 1;
+    }
+    if(pid == 0)
+    {
+        int fd = open(log_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd >= 0)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv.data());
+        std::fprintf(stderr, "cannot execute %s: %s\n", argv[0], std::strerror(errno));
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0)
+    {
+        LOG(ERROR) << "wait4 failed: " << std::strerror(errno);
+        return 1;
+    }
+    latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    peak_rss_kb = usage.ru_maxrss;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        LOG(ERROR) << args[0] << " failed, see " << log_file;
+        return 1;
+    }
+    return 0;
+}
+
+//"key": 值形式的一行，key必须在行首(忽略缩进)，value为冒号之后的部分
+static bool jsonLine(const string &line, const string &key, string &value)
+{
+    string trimmed = boost::algorithm::trim_copy(line);
+    string prefix = "\"" + key + "\":";
+    if(!boost::algorithm::starts_with(trimmed, prefix))
+        return false;
+    value = trimmed.substr(prefix.size());
+    return true;
+}
+
+//把text开头的数值读入value，之后只能是逗号或右括号
+static bool jsonNumber(const string &text, double &value)
+{
+    const char *begin = text.c_str();
+    char *end = nullptr;
+    value = std::strtod(begin, &end);
+    if(end == begin)
+        return false;
+    string rest = boost::algorithm::trim_copy(string(end));
+    return rest.empty() || rest[0] == ',' || rest[0] == '}';
+}
+
+//读取calculateDistance --report输出的report中的seconds、fps和batch_latency的p90
+//report每个顶层的键占一行，batch_latency的各项在同一行中
+//成功返回0，失败返回1
+int readReport(const string &report_file, VideoResult &result)
+{
+    std::ifstream input(report_file);
+    if(!input.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << report_file;
+        return 1;
+    }
+    bool has_seconds = false, has_fps = false, has_p90 = false;
+    string line, value;
+    while(std::getline(input, line))
+    {
+        if(jsonLine(line, "seconds", value))
+            has_seconds = jsonNumber(value, result.latency);
+        else if(jsonLine(line, "fps", value))
+            has_fps = jsonNumber(value, result.fps);
+        else if(jsonLine(line, "batch_latency", value))
+        {
+            size_t pos = value.find("\"p90\":");
+            has_p90 = pos != string::npos && jsonNumber(value.substr(pos + 6), result.batch_latency_p90);
+        }
+    }
+    if(!has_seconds || !has_fps || !has_p90)
+    {
+        LOG(ERROR) << "cannot find seconds, fps and batch_latency in " << report_file;
+        return 1;
+    }
+    return 0;
+}
+
+//按帧序号的顺序把candidate和硬切一一匹配，candidate落在[cut - 1 - tolerance, cut + tolerance]中时命中
+//成功返回0，失败返回1
+int matchCuts(const string &candidates_file, const vector<int> &cuts, int tolerance, int &num_candidates, int &hits)
+{
+    std::ifstream input(candidates_file);
+    if(!input.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << candidates_file;
+        return 1;
+    }
+    vector<int> candidates;
+    int frame_no;
+    while(input >> frame_no)
+        candidates.push_back(frame_no);
+    std::sort(candidates.begin(), candidates.end());
+    num_candidates = static_cast<int>(candidates.size());
+    hits = 0;
+    size_t next = 0;
+    for(int candidate : candidates)
+    {
+        while(next < cuts.size() && cuts[next] + tolerance < candidate)
+            ++next;
+        if(next < cuts.size() && cuts[next] - 1 - tolerance <= candidate)
+        {
+            ++hits;
+            ++next;
+        }
+    }
+    return 0;
+}
+
+void summarize(const vector<VideoResult> &results, double seconds, long peak_rss_kb, Summary &summary)
+{
+    double total_latency = 0;
+    long long total_frames = 0, total_cuts = 0, total_candidates = 0, total_hits = 0;
+    vector<double> latencies;
+    for(const VideoResult &result : results)
+    {
+        total_latency += result.latency;
+        total_frames += result.video->num_frames;
+        total_cuts += result.video->cuts.size();
+        total_candidates += result.num_candidates;
+        total_hits += result.hits;
+        latencies.push_back(result.latency);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    summary.seconds = seconds;
+    summary.fps = total_frames / seconds;
+    summary.latency_mean = total_latency / results.size();
+    summary.latency_p50 = latencies[(latencies.size() - 1) / 2];
+    summary.latency_p90 = latencies[(latencies.size() - 1) * 9 / 10];
+    summary.peak_rss_kb = peak_rss_kb;
+    summary.recall = total_cuts ? static_cast<double>(total_hits) / total_cuts : 1.0;
+    summary.precision = total_candidates ? static_cast<double>(total_hits) / total_candidates : 1.0;
+}
+
+//summary的每一项占一行，便于loadBaseline逐行读取
+void writeJson(std::ostream &out, const vector<string> &command, const vector<VideoResult> &results, const Summary &summary)
+{
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    out.precision(6);
+    out << "{\n  \"context\": {\"date\": " << jsonString(date) << ", \"num_cpus\": " << sysconf(_SC_NPROCESSORS_ONLN)
+        << ", \"command\": " << jsonString(boost::algorithm::join(command, " ")) << "},\n  \"videos\": [";
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const VideoResult &result = results[i];
+        const CorpusVideo &video = *result.video;
+        out << (i ? ",\n" : "\n") << "    {\"file\": " << jsonString(video.file) << ", \"width\": " << video.width
+            << ", \"height\": " << video.height << ", \"frames\": " << video.num_frames
+            << ", \"cuts\": " << video.cuts.size() << ", \"latency\": " << result.latency
+            << ", \"fps\": " << result.fps << ", \"batch_latency_p90\": " << result.batch_latency_p90
+            << ", \"candidates\": " << result.num_candidates << ", \"hits\": " << result.hits << "}";
+    }
+    out << "\n  ],\n  \"summary\": {"
+        << "\n    \"seconds\": " << summary.seconds << ","
+        << "\n    \"fps\": " << summary.fps << ","
+        << "\n    \"latency_mean\": " << summary.latency_mean << ","
+        << "\n    \"latency_p50\": " << summary.latency_p50 << ","
+        << "\n    \"latency_p90\": " << summary.latency_p90 << ","
+        << "\n    \"peak_rss_kb\": " << summary.peak_rss_kb << ","
+        << "\n    \"recall\": " << summary.recall << ","
+        << "\n    \"precision\": " << summary.precision
+        << "\n  }\n}\n";
+}
+
+//读取candidate文件中的帧序号，失败返回false
+static bool readCandidates(const string &candidates_file, vector<int> &candidates)
+{
+    std::ifstream input(candidates_file);
+    if(!input.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << candidates_file;
+        return false;
+    }
+    candidates.clear();
+    int frame_no;
+    while(input >> frame_no)
+        candidates.push_back(frame_no);
+    return true;
+}
+
+//用--segments num_segments重新运行command(去掉--workers，两者不能同时使用)，输出写入segments_dir，
+//把每个视频每个特征的candidate和output_dir中顺序处理的结果逐项比较
+//全部相同时返回0，否则返回1
+int checkSegments(const vector<string> &command, const vector<CorpusVideo> &corpus, const vector<string> &blob_names,
+    int num_segments, const string &output_dir, const string &segments_dir)
+{
+    boost::filesystem::create_directories(segments_dir);
+    vector<string> segments_command;
+    for(size_t i = 0; i + 1 < command.size(); ++i)
+    {
+        if(command[i] == "--workers")
+        {
+            ++i;
+            continue;
+        }
+        segments_command.push_back(command[i]);
+    }
+    segments_command.insert(segments_command.begin() + 1, {"--segments", std::to_string(num_segments)});
+    segments_command.push_back(segments_dir);
+    for(const CorpusVideo &video : corpus)
+    {
+        string video_name = video.file.substr(video.file.rfind('/') + 1);
+        for(const string &blob_name : blob_names)
+            boost::filesystem::remove(segments_dir + blob_name + "/" + video_name + "_candidates");
+    }
+    double seconds = 0;
+    long peak_rss_kb = 0;
+    if(runCalculateDistance(segments_command, segments_dir + "calculateDistance.log", seconds, peak_rss_kb))
+        return 1;
+    int mismatches = 0;
+    for(const CorpusVideo &video : corpus)
+    {
+        string video_name = video.file.substr(video.file.rfind('/') + 1);
+        for(const string &blob_name : blob_names)
+        {
+            vector<int> serial, segmented;
+            string suffix = blob_name + "/" + video_name + "_candidates";
+            if(!readCandidates(output_dir + suffix, serial) || !readCandidates(segments_dir + suffix, segmented))
+                return 1;
+            if(serial == segmented)
+                continue;
+            LOG(ERROR) << video_name << " " << blob_name << ": " << serial.size() << " candidates in serial processing, "
+                << segmented.size() << " with " << num_segments << " segments, see " << segments_dir + suffix;
+            ++mismatches;
+        }
+    }
+    LOG(INFO) << "--segments " << num_segments << ": " << mismatches << " candidate files differ from serial processing";
+    return mismatches ? 1 : 0;
+}
+
+//读取之前由本程序输出的JSON中的summary：从"summary": {所在的行开始，每行一个"key": 数值，直到右括号
+//成功返回0，失败返回1
+int loadBaseline(const string &baseline_file, Summary &baseline)
+{
+    std::ifstream input(baseline_file);
+    if(!input.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << baseline_file;
+        return 1;
+    }
+    struct Field{
+        const char *key;
+        double value;
+        bool found;
+    };
+    Field fields[] = {{"seconds", 0, false}, {"fps", 0, false}, {"latency_mean", 0, false}, {"latency_p50", 0, false},
+        {"latency_p90", 0, false}, {"peak_rss_kb", 0, false}, {"recall", 0, false}, {"precision", 0, false}};
+    bool in_summary = false;
+    string line, value;
+    while(std::getline(input, line))
+    {
+        if(!in_summary)
+        {
+            in_summary = jsonLine(line, "summary", value) && boost::algorithm::trim_copy(value) == "{";
+            continue;
+        }
+        if(boost::algorithm::starts_with(boost::algorithm::trim_copy(line), "}"))
+            break;
+        for(Field &field : fields)
+        {
+            if(jsonLine(line, field.key, value))
+                field.found = jsonNumber(value, field.value);
+        }
+    }
+    for(const Field &field : fields)
+    {
+        if(!field.found)
+        {
+            LOG(ERROR) << "cannot find " << field.key << " in the summary of " << baseline_file;
+            return 1;
+        }
+    }
+    baseline.seconds = fields[0].value;
+    baseline.fps = fields[1].value;
+    baseline.latency_mean = fields[2].value;
+    baseline.latency_p50 = fields[3].value;
+    baseline.latency_p90 = fields[4].value;
+    baseline.peak_rss_kb = static_cast<long>(fields[5].value);
+    baseline.recall = fields[6].value;
+    baseline.precision = fields[7].value;
+    return 0;
+}
+
+//打印和baseline的比较，有指标变差超过阈值时返回1
+int compareWithBaseline(const Summary &summary, const Summary &baseline, double max_regression)
+{
+    struct Metric{
+        const char *name;
+        double current, baseline;
+        bool higher_is_better;
+        bool absolute;      //召回率比较差值，其余比较相对变化
+    };
+    const Metric metrics[] = {
+        {"fps", summary.fps, baseline.fps, true, false},
+        {"latency_mean", summary.latency_mean, baseline.latency_mean, false, false},
+        {"latency_p90", summary.latency_p90, baseline.latency_p90, false, false},
+        {"peak_rss_kb", static_cast<double>(summary.peak_rss_kb), static_cast<double>(baseline.peak_rss_kb), false, false},
+        {"recall", summary.recall, baseline.recall, true, true},
+    };
+    const double max_recall_drop = 0.01;
+    int regressions = 0;
+    for(const Metric &metric : metrics)
+    {
+        double change = metric.absolute ? metric.current - metric.baseline
+            : (metric.baseline > 0 ? metric.current / metric.baseline - 1 : 0);
+        double worse = metric.higher_is_better ? -change : change;
+        bool regressed = worse > (metric.absolute ? max_recall_drop : max_regression);
+        std::fprintf(stderr, "%-13s baseline %12.4f current %12.4f change %+8.2f%s %s\n", metric.name, metric.baseline,
+            metric.current, change * 100, metric.absolute ? "pt" : "%", regressed ? "REGRESSION" : "ok");
+        regressions += regressed;
+    }
+    if(regressions)
+        LOG(ERROR) << regressions << " metrics regressed against the baseline";
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,297 @@
+#include <thread>
+#include <algorithm>
+#include <set>
+
+#include <glog/logging.h>
+#include "boost/algorithm/string.hpp"
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/blob.hpp"
+#include "caffe/util/io.hpp"
+#include "FeatureExtractor.hpp"
+#include "BlockingQueue.hpp"
+#include "Trace.hpp"
+
+using caffe::InputParameter;
+using caffe::Net;
+
+//流水线中各阶段缓冲区的个数
+const size_t kNumFrameBatches = 3;
+const size_t kNumInputBatches = 2;
+const size_t kNumFeatureBatches = 2;
+
+FeatureExtractor::FeatureExtractor(const string &pretrained_binary_proto, const string &feature_extraction_proto,
+    const string &extract_feature_blob_names, int new_height, int new_width)
+{
+    vector<string> blob_names;
+    boost::split(blob_names, extract_feature_blob_names, boost::is_any_of(","));
+    init(feature_extraction_proto, blob_names, new_height, new_width);
+    m_net->CopyTrainedLayersFrom(pretrained_binary_proto);
+}
+
+FeatureExtractor::FeatureExtractor(const FeatureExtractor *weights_owner)
+{
+    init(weights_owner->m_proto_file, weights_owner->m_blob_names, weights_owner->m_height, weights_owner->m_width);
+    m_net->ShareTrainedLayersWith(weights_owner->m_net.get());
+    m_preprocess_param = weights_owner->m_preprocess_param;
+}
+
+void FeatureExtractor::setNormalization(const vector<float> &mean, float scale)
+{
+    CHECK(mean.empty() || static_cast<int>(mean.size()) == m_channels)
+        << "the number of mean values must equal the number of channels";
+    m_preprocess_param.mean = mean;
+    m_preprocess_param.scale = scale;
+}
+
+//从最后一层向前，输出被需要的blob的层需要保留，其输入也变为被需要的blob；其余的层(最深的特征之后的层和无关的分支)被删除
+//in-place的层(如ReLU)输出和输入同名，会和产生该blob的层一起保留，特征的值和完整的网络相同
+static void pruneNet(const caffe::NetParameter &net_param, const vector<string> &blob_names, caffe::NetParameter *pruned_param)
+{
+    //先按TEST阶段过滤，和Net构造时的规则一致
+    caffe::NetParameter test_param(net_param);
+    test_param.mutable_state()->set_phase(caffe::TEST);
+    Net<float>::FilterNet(test_param, pruned_param);
+    std::set<string> required(blob_names.begin(), blob_names.end());
+    vector<bool> needed(pruned_param->layer_size(), false);
+    for(int i = pruned_param->layer_size() - 1; i >= 0; --i)
+    {
+        const caffe::LayerParameter &layer = pruned_param->layer(i);
+        for(int k = 0; k < layer.top_size() && !needed[i]; ++k)
+            needed[i] = required.count(layer.top(k)) > 0;
+        if(!needed[i])
+            continue;
+        for(int k = 0; k < layer.bottom_size(); ++k)
+            required.insert(layer.bottom(k));
+    }
+    caffe::NetParameter full_param(*pruned_param);
+    pruned_param->clear_layer();
+    for(int i = 0; i < full_param.layer_size(); ++i)
+    {
+        if(needed[i])
+            pruned_param->add_layer()->CopyFrom(full_param.layer(i));
+    }
+    pruned_param->mutable_state()->set_phase(caffe::TEST);
+    LOG(INFO) << "keeping " << pruned_param->layer_size() << " of " << full_param.layer_size()
+        << " layers needed by the feature blobs";
+}
+
+void FeatureExtractor::init(const string &feature_extraction_proto, const vector<string> &blob_names, int new_height, int new_width)
+{
+    m_proto_file = feature_extraction_proto;
+    m_profile = nullptr;
+    m_batch_size = 1;
+    m_channels = m_height = m_width = 0;
+    //获得batch_size
+    caffe::NetParameter net_param;
+    CHECK(ReadProtoFromTextFile(feature_extraction_proto, &net_param))
+        << "Failed to parse input text file as NetParameter: "
+        << feature_extraction_proto;
+    for(int i  = 0; i < net_param.layer_size();++i)
+    {
+        if(net_param.layer(i).name() == "data" && net_param.layer(i).type() == "Input")
+        {
+            CHECK(net_param.layer(i).has_input_param())
+                << "input layer data must have input_param";
+            const InputParameter &input_param = net_param.layer(i).input_param();
+            CHECK_GE(input_param.shape_size(),1) << "the input_param must specify the shape of input blob";
+            const caffe::BlobShape &input_shape = input_param.shape(0);
+            m_batch_size = input_shape.dim(0);
+            m_channels = input_shape.dim(1);
+            m_height = input_shape.dim(2);
+            m_width = input_shape.dim(3);
+            CHECK_EQ(m_height,new_height) << "new height must equal the height in input layer";
+            CHECK_EQ(m_width,new_width) << "new width must equal the width in input layer";
+        }
+    }
+
+    //初始化网络，只保留要提取的特征依赖的层
+    caffe::NetParameter pruned_param;
+    pruneNet(net_param, blob_names, &pruned_param);
+    m_net.reset(new Net<float>(pruned_param));
+    m_blob_names = blob_names;
+    size_t num_features = m_blob_names.size();
+    for (size_t i = 0; i < num_features; i++) {
+        CHECK(m_net->has_blob(m_blob_names[i]))
+            << "Unknown feature blob name " << m_blob_names[i]
+            << " in the network " << feature_extraction_proto;
+        m_dim_features.push_back(m_net->blob_by_name(m_blob_names[i])->count() / m_batch_size);
+    }
+
+    m_preprocess_param.channels = m_channels;
+    m_preprocess_param.height = m_height;
+    m_preprocess_param.width = m_width;
+
+    //分配流水线的缓冲区
+    m_resized.resize(m_batch_size);
+    m_frame_batches.assign(kNumFrameBatches, FrameBatch(m_batch_size));
+    m_input_batches.resize(kNumInputBatches);
+    for(auto &batch : m_input_batches)
+        batch.data.resize(m_batch_size * m_channels * m_height * m_width);
+    m_feature_batches.resize(kNumFeatureBatches);
+    for(auto &batch : m_feature_batches)
+    {
+        batch.features.resize(num_features);
+        for(size_t i = 0; i < num_features; ++i)
+            batch.features[i].resize(m_batch_size * m_dim_features[i]);
+    }
+}
+
+//流水线：解码线程 -> 预处理线程 -> 前向计算(当前线程) -> 距离计算线程
+//各阶段之间通过有界队列传递数据，数据缓冲区在free_*队列中循环使用，不会在每个batch上重新分配
+int FeatureExtractor::extract(cv::VideoCapture &cap, DistanceState &state, int first_frame, int end_frame)
+{
+    const size_t num_features = m_blob_names.size();
+    boost::shared_ptr<caffe::Blob<float> > input_blob = m_net->blob_by_name("data");
+
+    BlockingQueue<FrameBatch*> free_frames(m_frame_batches.size()), decoded_queue(m_frame_batches.size());
+    BlockingQueue<InputBatch*> free_inputs(m_input_batches.size()), input_queue(m_input_batches.size());
+    BlockingQueue<FeatureBatch*> free_features(m_feature_batches.size()), feature_queue(m_feature_batches.size());
+    for(auto &batch : m_frame_batches)
+        free_frames.push(&batch);
+    for(auto &batch : m_input_batches)
+        free_inputs.push(&batch);
+    for(auto &batch : m_feature_batches)
+        free_features.push(&batch);
+
+    //解码线程：每次解码batch_size个需要的帧
+    //只有序号为frame_step整数倍的帧会被比较，其余帧只grab不retrieve，也不进入batch，帧的序号保持不变
+    const int frame_step = state.frameStep();
+    const int video = Tracer::currentVideo();   //流水线的线程记录的事件和当前线程属于同一个视频
+    int decoded_end = first_frame;
+    std::thread decoder([&]{
+        Tracer::setThreadName("decode");
+        Tracer::setCurrentVideo(video);
+        int frame_no = first_frame;
+        bool finished = false;
+        FrameBatch *batch = nullptr;
+        while(!finished && free_frames.pop(batch))
+        {
+            batch->decode_begin = StageProfile::Clock::now();
+            batch->frame_nos.clear();
+            const int batch_first_frame = frame_no;
+            int j = 0;
+            while(j < m_batch_size)
+            {
+                if(frame_no >= end_frame)
+                {
+                    finished = true;
+                    break;
+                }
+                if(frame_no % frame_step != 0)
+                {
+                    if(!cap.grab())
+                    {
+                        finished = true;
+                        break;
+                    }
+                    ++frame_no;
+                    continue;
+                }
+                if(!cap.read(batch->frames[j]) || batch->frames[j].empty())
+                {
+                    finished = true;
+                    break;
+                }
+                batch->frame_nos.push_back(frame_no++);
+                ++j;
+            }
+            if(Tracer::enabled())
+                Tracer::record("decode", batch->decode_begin, Tracer::Clock::now());
+            if(m_profile != nullptr)
+            {
+                m_profile->addTime(kDecodeStage, batch->decode_begin);
+                m_profile->addFrames(frame_no - batch_first_frame, batch->frame_nos.size());
+            }
+            if(!batch->frame_nos.empty())
+                decoded_queue.push(batch);
+        }
+        decoded_end = frame_no;
+        decoded_queue.close();
+    });
+
+    //预处理线程：缩放图像并转换为网络输入的格式，一个batch中的各帧并行处理
+    std::thread preprocessor([&]{
+        Tracer::setThreadName("preprocess");
+        Tracer::setCurrentVideo(video);
+        FrameBatch *frames = nullptr;
+        InputBatch *input = nullptr;
+        while(decoded_queue.pop(frames) && free_inputs.pop(input))
+        {
+            {
+                ScopedTimer timer(m_profile, kPreprocessStage);
+                TraceScope trace("preprocess");
+                preprocessFrames(frames->frames, frames->frame_nos.size(), m_resized, input->data.data(), m_preprocess_param);
+            }
+            input->frame_nos = frames->frame_nos;
+            input->decode_begin = frames->decode_begin;
+            free_frames.push(frames);
+            input_queue.push(input);
+        }
+        input_queue.close();
+    });
+
+    //每个特征缓冲区中的batch开始解码的时间，用于计算batch的延迟
+    vector<StageProfile::Clock::time_point> feature_decode_begin(m_feature_batches.size());
+    //距离计算线程，同时把特征写入缓存
+    std::thread distance_worker([&]{
+        Tracer::setThreadName("distance");
+        Tracer::setCurrentVideo(video);
+        FeatureBatch *features = nullptr;
+        while(feature_queue.pop(features))
+        {
+            {
+                ScopedTimer timer(m_writers.empty() ? nullptr : m_profile, kOutputStage);
+                TraceScope trace(m_writers.empty() ? nullptr : "write_cache");
+                for(size_t feature_index = 0; feature_index < m_writers.size(); ++feature_index)
+                    m_writers[feature_index]->append(features->features[feature_index].data(), features->frame_nos);
+            }
+            {
+                ScopedTimer timer(m_profile, kDistanceStage);
+                TraceScope trace("distance");
+                state.update(*features);
+            }
+            if(m_profile != nullptr)
+                m_profile->addBatchLatency(feature_decode_begin[features - m_feature_batches.data()]);
+            free_features.push(features);
+        }
+    });
+
+    //前向计算，输入blob直接指向预处理好的缓冲区，不再拷贝
+    InputBatch *input = nullptr;
+    FeatureBatch *features = nullptr;
+    while(input_queue.pop(input))
+    {
+        LOG(ERROR) << "extract features of frame " << input->frame_nos.front() << " to frame " << input->frame_nos.back();
+        //前向计算的时间包括Forward和特征的拷贝，不包括等待空闲特征缓冲区的时间
+        StageProfile::Clock::time_point forward_begin = StageProfile::Clock::now();
+        input_blob->set_cpu_data(input->data.data());
+        m_net->Forward();//提取特征
+        StageProfile::Clock::time_point forward_end = StageProfile::Clock::now();
+        if(Tracer::enabled())
+            Tracer::record("forward", forward_begin, forward_end);
+        StageProfile::Clock::duration forward_time = forward_end - forward_begin;
+        free_features.pop(features);
+        forward_begin = StageProfile::Clock::now();
+        {
+            TraceScope trace("copy_features");
+            for(size_t feature_index = 0; feature_index < num_features; ++feature_index)
+            {
+                const float *feature_blob_data = m_net->blob_by_name(m_blob_names[feature_index])->cpu_data();
+                std::copy(feature_blob_data, feature_blob_data + input->frame_nos.size() * m_dim_features[feature_index],
+                    features->features[feature_index].begin());
+            }
+        }
+        if(m_profile != nullptr)
+            m_profile->addTime(kForwardStage, forward_time + (StageProfile::Clock::now() - forward_begin));
+        features->frame_nos = input->frame_nos;
+        feature_decode_begin[features - m_feature_batches.data()] = input->decode_begin;
+        free_inputs.push(input);
+        feature_queue.push(features);
+    }
+    feature_queue.close();
+    decoder.join();
+    preprocessor.join();
+    distance_worker.join();
+    return decoded_end;
+}
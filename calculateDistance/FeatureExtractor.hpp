@@ -0,0 +1,84 @@
+/*
+**用于为视频的所有帧提取深度特征。网络只在构造时加载一次，之后可以被多个视频复用*
+**提取过程是一个流水线：解码线程 -> 预处理线程 -> 前向计算 -> 距离计算线程*
+*/
+#ifndef FEATUREEXTRACTOR_HPP_
+#define FEATUREEXTRACTOR_HPP_
+
+#include <string>
+#include <vector>
+#include <climits>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "caffe/net.hpp"
+#include "DistanceState.hpp"
+#include "Preprocess.hpp"
+#include "FeatureStore.hpp"
+#include "StageProfile.hpp"
+
+using std::string;
+using std::vector;
+
+//解码得到的一批视频帧
+struct FrameBatch{
+    explicit FrameBatch(int batch_size):frames(batch_size){}
+    vector<cv::Mat> frames;
+    vector<int> frame_nos;  //各帧在视频中的序号，相邻两帧的序号相差frameStep()
+    StageProfile::Clock::time_point decode_begin;   //开始解码这一批帧的时间
+};
+
+//转换成网络输入格式(CHW,float)的一批视频帧
+struct InputBatch{
+    vector<float> data;
+    vector<int> frame_nos;
+    StageProfile::Clock::time_point decode_begin;
+};
+
+class FeatureExtractor{
+public:
+    //pretrained_binary_proto: 训练好的网络模型的参数
+    //feature_extraction_proto: 网络的proto txt文件
+    //extract_feature_blob_names: 要提取的特征名字，用逗号隔开
+    //new_height,new_width: 视频帧用作网络输入时应转换成的新大小，必须和网络输入层一致
+    FeatureExtractor(const string &pretrained_binary_proto, const string &feature_extraction_proto,
+        const string &extract_feature_blob_names, int new_height, int new_width);
+    //创建一个和weights_owner结构相同的特征提取器，共享weights_owner中训练好的参数，
+    //只为激活值和流水线缓冲区分配新的内存。用于多个线程同时处理不同的视频
+    explicit FeatureExtractor(const FeatureExtractor *weights_owner);
+    ~FeatureExtractor(){}
+    //解码cap中的帧并提取特征，每得到一批帧的特征就交给state计算距离
+    //cap应已定位到第first_frame帧，最多解码到第end_frame帧(不含)或视频结束
+    //只为序号是state.frameStep()整数倍的帧提取特征
+    //返回解码结束的位置，即最后解码(包括跳过)的一帧的序号加1，视频提前结束时小于end_frame
+    int extract(cv::VideoCapture &cap, DistanceState &state, int first_frame = 0, int end_frame = INT_MAX);
+    //设置预处理时减去的各通道均值(为空时不减)和缩放系数
+    void setNormalization(const vector<float> &mean, float scale);
+    //设置之后extract()把第i个特征同时写入writers[i]，传入空数组则不再写入
+    void setFeatureWriters(const vector<FeatureStoreWriter*> &writers) {m_writers = writers;}
+    //设置之后extract()把各阶段的时间、帧数和每个batch的延迟记录到profile中，传入nullptr则不再记录
+    void setProfile(StageProfile *profile) {m_profile = profile;}
+    const PreprocessParam& preprocessParam() const {return m_preprocess_param;}
+    const vector<string>& blobNames() const {return m_blob_names;}
+    const vector<int>& featureDims() const {return m_dim_features;}  //各个特征的维度
+private:
+    //根据proto文件构建网络(不加载参数)，只保留blob_names依赖的层，并分配流水线的缓冲区
+    void init(const string &feature_extraction_proto, const vector<string> &blob_names, int new_height, int new_width);
+
+    string m_proto_file;
+    boost::shared_ptr<caffe::Net<float> > m_net;
+    vector<string> m_blob_names;
+    vector<int> m_dim_features;
+    int m_batch_size;
+    int m_channels, m_height, m_width;
+    PreprocessParam m_preprocess_param;
+    vector<cv::Mat> m_resized;  //预处理时每一帧缩放后的图像，复用内存
+    //流水线中循环使用的缓冲区，在构造时分配，处理各个视频时复用
+    vector<FrameBatch> m_frame_batches;
+    vector<InputBatch> m_input_batches;     //双缓冲，第k+1个batch的解码和转换与第k个batch的Forward重叠
+    vector<FeatureBatch> m_feature_batches;
+    vector<FeatureStoreWriter*> m_writers;
+    StageProfile *m_profile;
+};
+#endif
@@ -0,0 +1,66 @@
+#include <cstdlib>
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "FeatureRing.hpp"
+
+//每一行的起始地址按64字节对齐，向量化的距离计算不会跨缓存行读取行首
+const size_t kRowAlignment = 64;
+
+static float* allocateRows(size_t size)
+{
+    void *data = nullptr;
+    int rc = posix_memalign(&data, kRowAlignment, std::max<size_t>(size, 1) * sizeof(float));
+    CHECK_EQ(rc, 0) << "cannot allocate the feature ring";
+    return static_cast<float*>(data);
+}
+
+FeatureRing::FeatureRing(int capacity, int dim)
+    :m_capacity(capacity),m_dim(dim),m_begin(0),m_end(0),m_data(nullptr, std::free)
+{
+    CHECK_GE(capacity, 1);
+    const size_t floats_per_line = kRowAlignment / sizeof(float);
+    m_stride = (dim + floats_per_line - 1) / floats_per_line * floats_per_line;
+    m_data.reset(allocateRows(m_stride * capacity));
+}
+
+FeatureRing::FeatureRing(const FeatureRing &other)
+    :m_capacity(other.m_capacity),m_dim(other.m_dim),m_stride(other.m_stride),m_begin(other.m_begin),m_end(other.m_end),
+    m_data(allocateRows(other.m_stride * other.m_capacity), std::free)
+{
+    std::copy(other.m_data.get(), other.m_data.get() + m_stride * m_capacity, m_data.get());
+}
+
+FeatureRing& FeatureRing::operator=(FeatureRing other)
+{
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_dim, other.m_dim);
+    std::swap(m_stride, other.m_stride);
+    std::swap(m_begin, other.m_begin);
+    std::swap(m_end, other.m_end);
+    m_data.swap(other.m_data);
+    return *this;
+}
+
+void FeatureRing::push(int first_id, const float *rows, int num)
+{
+    CHECK_GE(first_id, m_end) << "rows must be pushed in increasing order";
+    if(first_id != m_end)
+        m_begin = first_id;
+    //只有最后capacity行会被保留
+    const int skip = std::max(0, num - m_capacity);
+    for(int k = skip; k < num; ++k)
+    {
+        const float *src = rows + static_cast<size_t>(k) * m_dim;
+        std::copy(src, src + m_dim, m_data.get() + static_cast<size_t>((first_id + k) % m_capacity) * m_stride);
+    }
+    m_end = first_id + num;
+    m_begin = std::max(m_begin, m_end - m_capacity);
+}
+
+const float* FeatureRing::row(int id) const
+{
+    CHECK(id >= m_begin && id < m_end) << "row " << id << " is not in the feature ring [" << m_begin << ", " << m_end << ")";
+    return m_data.get() + static_cast<size_t>(id % m_capacity) * m_stride;
+}
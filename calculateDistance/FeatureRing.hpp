@@ -0,0 +1,34 @@
+/*
+**保存一个特征最近若干行的环形缓冲区，用于跨batch的帧比较*
+**所有行放在一块预先分配、按缓存行对齐的内存中，写入和读取都不分配内存*
+*/
+#ifndef FEATURERING_HPP_
+#define FEATURERING_HPP_
+
+#include <cstddef>
+#include <memory>
+
+class FeatureRing{
+public:
+    //capacity: 最多保存的行数
+    //dim: 每一行特征的维度
+    FeatureRing(int capacity, int dim);
+    FeatureRing(const FeatureRing &other);     //复制时分配新的内存，DistanceState可以按值复制
+    FeatureRing& operator=(FeatureRing other);
+    void reset() {m_begin = m_end = 0;}
+    //写入编号为first_id, first_id + 1, ...的num行，rows中每行dim个元素连续存放
+    //first_id必须不小于已写入的最后一行的编号加1，中间跳过的行视为不存在，
+    //超出容量时最早的行被覆盖
+    void push(int first_id, const float *rows, int num);
+    //编号为id的行，要求该行还在缓冲区中
+    const float* row(int id) const;
+    int capacity() const {return m_capacity;}
+private:
+    int m_capacity;
+    int m_dim;
+    size_t m_stride;    //每行占用的元素个数，补齐到缓存行的整数倍
+    int m_begin;        //缓冲区中的行的编号为[m_begin, m_end)
+    int m_end;
+    std::unique_ptr<float, void(*)(void*)> m_data;
+};
+#endif
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+#include <glog/logging.h>
+#include "boost/filesystem.hpp"
+
+#include "FeatureStore.hpp"
+
+//计算文件内容的哈希时每次读取的字节数
+const size_t kHashChunkSize = 1 << 20;
+//从缓存中读取特征时每批交给DistanceState的帧数
+const int kReplayBatchSize = 64;
+
+//FNV-1a哈希
+static uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//FNV-1a按8字节的字处理，比逐字节快约8倍，不足8字节的结尾逐字节处理
+//乘法只把低位的变化传到高位，每个字之后把高32位折回低位，字中任意一个字节的变化都会影响整个哈希
+static uint64_t hashWords(const char *data, size_t size, uint64_t hash)
+{
+    size_t num_words = size / sizeof(uint64_t);
+    for(size_t i = 0; i < num_words; ++i)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i * sizeof(uint64_t), sizeof(uint64_t));
+        hash ^= word;
+        hash *= 1099511628211ULL;
+        hash ^= hash >> 32;
+    }
+    return hashBytes(data + num_words * sizeof(uint64_t), size % sizeof(uint64_t), hash);
+}
+
+//对整个文件的内容和大小做哈希，只有内容完全相同的文件才会得到同一个缓存
+//读取整个文件的时间远小于解码和Forward的时间；不是普通文件时返回false
+static bool hashFile(const string &file_name, uint64_t &hash)
+{
+    boost::system::error_code ec;
+    if(!boost::filesystem::is_regular_file(file_name, ec))
+        return false;
+    std::ifstream input(file_name, std::ios::binary);
+    if(!input.is_open())
+        return false;
+    vector<char> buffer(kHashChunkSize);
+    uint64_t size = 0;
+    hash = 14695981039346656037ULL;
+    while(input.read(buffer.data(), buffer.size()) || input.gcount() > 0)
+    {
+        //每块都是kHashChunkSize字节(8的倍数)，只有最后一块可能有不足8字节的结尾
+        hash = hashWords(buffer.data(), input.gcount(), hash);
+        size += input.gcount();
+    }
+    if(input.bad())
+        return false;
+    hash = hashBytes(&size, sizeof(size), hash);
+    return true;
+}
+
+FeatureStoreWriter::FeatureStoreWriter(const string &file_name, int dim, int frame_step)
+    :m_file_name(file_name),m_frame_step(frame_step),m_failed(false)
+{
+    if(m_writer.open(file_name, dim, frame_step))
+        LOG(ERROR) << "cannot create the file " << file_name;
+}
+
+void FeatureStoreWriter::append(const float *features, const vector<int> &frame_nos)
+{
+    if(m_failed || !m_writer.isOpen())
+        return;
+    for(size_t j = 0; j < frame_nos.size(); ++j)
+    {
+        if(frame_nos[j] != static_cast<int64_t>(m_writer.numFrames() + j) * m_frame_step)
+        {
+            LOG(ERROR) << "frame " << frame_nos[j] << " is out of order, the features of " << m_file_name << " will not be cached";
+            m_failed = true;
+            return;
+        }
+    }
+    m_writer.append(features, frame_nos.size());
+}
+
+int FeatureStoreWriter::commit()
+{
+    //不调用m_writer.close()时，临时文件会在析构时被删除
+    if(m_failed || m_writer.numFrames() == 0)
+        return 1;
+    if(m_writer.close())
+    {
+        LOG(ERROR) << "cannot write the file " << m_file_name;
+        return 1;
+    }
+    return 0;
+}
+
+FeatureStore::FeatureStore(const string &cache_dir, const string &pretrained_binary_proto, const string &feature_extraction_proto,
+    const PreprocessParam &param)
+    :m_cache_dir(cache_dir)
+{
+    if(m_cache_dir.back() != '/')
+        m_cache_dir.push_back('/');
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(m_cache_dir, ec);
+    CHECK(!ec) << "cannot create the directory " << m_cache_dir;
+    //模型标识：网络结构、训练好的参数和预处理参数
+    std::ifstream proto(feature_extraction_proto, std::ios::binary);
+    CHECK(proto.is_open()) << "cannot open the file " << feature_extraction_proto;
+    string proto_content((std::istreambuf_iterator<char>(proto)), std::istreambuf_iterator<char>());
+    m_model_hash = hashBytes(proto_content.data(), proto_content.size());
+    uint64_t weights_hash = 0;
+    CHECK(hashFile(pretrained_binary_proto, weights_hash)) << "cannot read the file " << pretrained_binary_proto;
+    m_model_hash = hashBytes(&weights_hash, sizeof(weights_hash), m_model_hash);
+    int shape[3] = {param.channels, param.height, param.width};
+    m_model_hash = hashBytes(shape, sizeof(shape), m_model_hash);
+    m_model_hash = hashBytes(param.mean.data(), param.mean.size() * sizeof(float), m_model_hash);
+    m_model_hash = hashBytes(&param.scale, sizeof(param.scale), m_model_hash);
+}
+
+//缓存文件名：视频内容的哈希-模型和特征名的哈希.feat
+string FeatureStore::fileName(uint64_t video_hash, const string &blob_name) const
+{
+    uint64_t feature_hash = hashBytes(blob_name.data(), blob_name.size(), m_model_hash);
+    std::ostringstream name;
+    name << m_cache_dir << std::hex << std::setfill('0') << std::setw(16) << video_hash
+        << "-" << std::setw(16) << feature_hash << ".feat";
+    return name.str();
+}
+
+bool FeatureStore::hashVideo(const string &video_file, uint64_t &video_hash) const
+{
+    return hashFile(video_file, video_hash);
+}
+
+int FeatureStore::load(uint64_t video_hash, const vector<string> &blob_names, const vector<int> &dim_features,
+    DistanceState &state) const
+{
+    size_t num_features = blob_names.size();
+    vector<FeatureFileReader> readers(num_features);
+    size_t num_frames = 0;
+    for(size_t i = 0; i < num_features; ++i)
+    {
+        if(readers[i].open(fileName(video_hash, blob_names[i])))
+            return 1;
+        if(readers[i].dim() != dim_features[i] || state.frameStep() % readers[i].frameStep() != 0)
+            return 1;
+        if(i > 0 && (readers[i].frameStep() != readers[0].frameStep() || readers[i].numFrames() != num_frames))
+            return 1;
+        num_frames = readers[i].numFrames();
+    }
+    //只把序号为state.frameStep()整数倍的帧交给state，和解码时跳过的帧一致
+    const int cached_step = readers[0].frameStep();
+    const size_t stride = state.frameStep() / cached_step;
+    FeatureBatch batch;
+    batch.features.resize(num_features);
+    for(size_t i = 0; i < num_features; ++i)
+        batch.features[i].resize(kReplayBatchSize * dim_features[i]);
+    for(size_t row = 0; row < num_frames; row += stride)
+    {
+        size_t j = batch.frame_nos.size();
+        for(size_t i = 0; i < num_features; ++i)
+            std::copy(readers[i].row(row), readers[i].row(row) + dim_features[i], batch.features[i].begin() + j * dim_features[i]);
+        batch.frame_nos.push_back(row * cached_step);
+        if(batch.frame_nos.size() == kReplayBatchSize || row + stride >= num_frames)
+        {
+            state.update(batch);
+            batch.frame_nos.clear();
+        }
+    }
+    return 0;
+}
+
+vector<shared_ptr<FeatureStoreWriter>> FeatureStore::createWriters(uint64_t video_hash, const vector<string> &blob_names,
+    const vector<int> &dim_features, int frame_step) const
+{
+    vector<shared_ptr<FeatureStoreWriter>> writers;
+    for(size_t i = 0; i < blob_names.size(); ++i)
+    {
+        writers.push_back(shared_ptr<FeatureStoreWriter>(
+            new FeatureStoreWriter(fileName(video_hash, blob_names[i]), dim_features[i], frame_step)));
+        if(!writers.back()->isOpen())
+            return vector<shared_ptr<FeatureStoreWriter>>();
+    }
+    return writers;
+}
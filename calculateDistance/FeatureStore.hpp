@@ -0,0 +1,60 @@
+/*
+**持久化的特征缓存，按视频内容和模型/特征名对每一帧的特征进行缓存，视频内容由整个文件的哈希标识*
+**调整采样率、距离类型或过滤参数后重新运行时，命中缓存的视频不再解码和Forward，*
+**直接从内存映射的特征文件中读取特征计算距离*
+**每个(视频，特征)对应一个FeatureFile.hpp格式的特征文件，第i行为第i * frame_step帧的特征*
+*/
+#ifndef FEATURESTORE_HPP_
+#define FEATURESTORE_HPP_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "DistanceState.hpp"
+#include "FeatureFile.hpp"
+#include "Preprocess.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+//顺序写入一个视频的某个特征，检查帧序号是否连续，任何一批帧不连续时都不会留下缓存文件
+class FeatureStoreWriter{
+public:
+    FeatureStoreWriter(const string &file_name, int dim, int frame_step);
+    ~FeatureStoreWriter(){}
+    bool isOpen() const {return m_writer.isOpen();}
+    //追加一批帧的特征，frame_nos必须从0开始依次相差frame_step
+    void append(const float *features, const vector<int> &frame_nos);
+    int commit();   //写入文件头并改名为正式的文件名，成功返回0，失败返回1
+private:
+    string m_file_name;
+    int m_frame_step;
+    FeatureFileWriter m_writer;
+    bool m_failed;
+};
+
+class FeatureStore{
+public:
+    //cache_dir: 缓存目录，不存在时会被创建
+    //pretrained_binary_proto, feature_extraction_proto, param: 参与计算模型标识，任何一项变化都会使缓存失效
+    FeatureStore(const string &cache_dir, const string &pretrained_binary_proto, const string &feature_extraction_proto,
+        const PreprocessParam &param);
+    //读取整个视频文件计算内容的哈希，作为load和createWriters的参数；视频不是普通文件(如直播流)时返回false
+    bool hashVideo(const string &video_file, uint64_t &video_hash) const;
+    //如果哈希为video_hash的视频的所有特征都已被缓存，并且缓存的帧间隔能整除state.frameStep()，
+    //就从缓存中读取特征交给state计算距离，成功返回0；否则返回1，state保持不变
+    int load(uint64_t video_hash, const vector<string> &blob_names, const vector<int> &dim_features,
+        DistanceState &state) const;
+    //为哈希为video_hash的视频的每个特征创建一个writer，无法创建文件时返回空数组
+    vector<shared_ptr<FeatureStoreWriter>> createWriters(uint64_t video_hash, const vector<string> &blob_names,
+        const vector<int> &dim_features, int frame_step) const;
+private:
+    string fileName(uint64_t video_hash, const string &blob_name) const;
+
+    string m_cache_dir;
+    uint64_t m_model_hash;
+};
+#endif
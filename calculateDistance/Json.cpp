@@ -0,0 +1,33 @@
+#include <cstdio>
+
+#include "Json.hpp"
+
+string jsonString(const string &s)
+{
+    string quoted("\"");
+    for(char c : s)
+    {
+        switch(c)
+        {
+        case '"': quoted += "\\\""; break;
+        case '\\': quoted += "\\\\"; break;
+        case '\b': quoted += "\\b"; break;
+        case '\f': quoted += "\\f"; break;
+        case '\n': quoted += "\\n"; break;
+        case '\r': quoted += "\\r"; break;
+        case '\t': quoted += "\\t"; break;
+        default:
+            //其余控制字符写成\u00XX，非ASCII的UTF-8字节原样保留
+            if(static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                quoted += escaped;
+            }
+            else
+                quoted.push_back(c);
+        }
+    }
+    quoted.push_back('"');
+    return quoted;
+}
@@ -0,0 +1,13 @@
+/*
+**写JSON文件时共用的辅助函数，calculateDistance和各个工具共用*
+*/
+#ifndef JSON_HPP_
+#define JSON_HPP_
+
+#include <string>
+
+using std::string;
+
+//返回加上双引号的JSON字符串，按JSON规范转义引号、反斜杠和所有控制字符(小于0x20)
+string jsonString(const string &s);
+#endif
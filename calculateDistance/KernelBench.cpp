@@ -0,0 +1,105 @@
+/*
+**DistanceKernels.hpp的校验和性能测试*
+**对当前CPU支持的每个指令集、每种距离度量和若干特征维度，先和double精度的参考实现比较结果，再测量每次调用的时间*
+**用法：kernelBench [min_seconds]，有结果不一致时返回1*
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "DistanceKernels.hpp"
+
+using std::vector;
+
+const char *kMetricNames[kNumMetrics] = {"Cosine", "L2", "L1", "ChiSquare", "HistIntersection", "Hamming"};
+//SqueezeNet中prob/pool10的1000维，conv10的13x13x1000维，以及不能被向量长度整除的维度
+const int kDims[] = {kSpecializedDim, 7, 513, 4096, 169000};
+const int kNumVectors = 64;
+
+//各ISA之间的累加顺序不同，允许一定的相对误差；Hamming的结果是整数计数，必须完全一致
+static bool closeEnough(KernelMetric metric, double expected, double actual, int dim)
+{
+    if(std::isnan(expected))    //全零向量的Cosine距离没有定义
+        return std::isnan(actual);
+    if(metric == kHamming)
+        return std::fabs(expected - actual) * dim < 0.5;
+    double tolerance = 1e-4 * std::sqrt(static_cast<double>(dim)) + 1e-5;
+    return std::fabs(expected - actual) <= tolerance * std::max(1.0, std::fabs(expected));
+}
+
+//在kNumVectors个向量上循环计算相邻向量的距离，返回每次调用的平均纳秒数
+static double timeKernel(DistanceKernel kernel, const vector<float> &data, int dim, double min_seconds)
+{
+    typedef std::chrono::steady_clock Clock;
+    volatile float sink = 0;
+    long long calls = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    do
+    {
+        for(int i = 0; i + 1 < kNumVectors; ++i)
+            sink = sink + kernel(data.data() + static_cast<size_t>(i) * dim, data.data() + static_cast<size_t>(i + 1) * dim, dim);
+        calls += kNumVectors - 1;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }while(elapsed < min_seconds);
+    return elapsed * 1e9 / calls;
+}
+
+int main(int argc, char **argv)
+{
+    double min_seconds = argc > 1 ? std::atof(argv[1]) : 0.1;
+    vector<const KernelTable*> tables(1, &scalarKernels());
+    if(avx2Kernels())
+        tables.push_back(avx2Kernels());
+    if(avx512Kernels())
+        tables.push_back(avx512Kernels());
+    std::printf("dispatch: %s\n", distanceKernels().isa);
+    std::printf("%-8s %-17s %7s %6s %12s %10s\n", "isa", "metric", "dim", "fixed", "ns/call", "GB/s");
+
+    std::mt19937 rng(2018);
+    //一半的维度为0，使ChiSquare和Hamming的分支都能被覆盖
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    int failures = 0;
+    for(int dim : kDims)
+    {
+        vector<float> data(static_cast<size_t>(kNumVectors) * dim);
+        for(auto &x : data)
+            x = std::max(0.0f, value(rng));
+        for(int m = 0; m < kNumMetrics; ++m)
+        {
+            KernelMetric metric = static_cast<KernelMetric>(m);
+            for(const KernelTable *table : tables)
+            {
+                for(int fixed = 0; fixed < 2; ++fixed)
+                {
+                    if(fixed && dim != kSpecializedDim)
+                        continue;
+                    DistanceKernel kernel = fixed ? table->fixed[m] : table->generic[m];
+                    for(int i = 0; i + 1 < kNumVectors; ++i)
+                    {
+                        const float *a = data.data() + static_cast<size_t>(i) * dim, *b = a + dim;
+                        double expected = referenceDistance<double>(metric, vector<double>(a, a + dim).data(),
+                            vector<double>(b, b + dim).data(), dim);
+                        double actual = kernel(a, b, dim);
+                        if(!closeEnough(metric, expected, actual, dim))
+                        {
+                            std::printf("MISMATCH %s %s dim=%d fixed=%d pair=%d: expected %.8g, got %.8g\n",
+                                table->isa, kMetricNames[m], dim, fixed, i, expected, actual);
+                            ++failures;
+                            break;
+                        }
+                    }
+                    double ns = timeKernel(kernel, data, dim, min_seconds);
+                    std::printf("%-8s %-17s %7d %6s %12.1f %10.2f\n", table->isa, kMetricNames[m], dim, fixed ? "yes" : "no",
+                        ns, 2.0 * dim * sizeof(float) / ns);
+                }
+            }
+        }
+    }
+    if(failures)
+        std::printf("%d kernels disagree with the reference implementation\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+/*
+**特征提取网络的逐层耗时分析*
+**用ForwardFromTo逐层运行网络，统计每一层在N个batch上每个batch的平均耗时和占总耗时的比例，以及每一层输出blob的内存，*
+**对每个要提取的特征blob，给出顺序执行到产生它的最后一层为止的累计耗时(即ForwardTo的代价)，*
+**以及只执行它依赖的层时的耗时，用于按代价和检测效果选择特征blob*
+*/
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <set>
+
+#include <glog/logging.h>
+#include "boost/algorithm/string.hpp"
+
+#include "caffe/net.hpp"
+#include "Options.hpp"
+
+#ifndef LAYERPROFILE_DEFAULT_NET
+#define LAYERPROFILE_DEFAULT_NET "squzzeNet.prototxt"
+#endif
+
+using std::string;
+using std::vector;
+using caffe::Caffe;
+using caffe::Net;
+
+typedef std::chrono::steady_clock Clock;
+
+struct LayerStats{
+    string name;
+    string type;
+    vector<double> seconds;     //每个batch上的耗时
+    double mean_ms;
+    double stddev_ms;
+    size_t top_bytes;           //非in-place输出blob的内存
+    string tops;
+};
+
+void profileLayers(Net<float> &net, int num_batches, int warmup, vector<LayerStats> &stats, vector<double> &forward_seconds);
+int lastWriter(const Net<float> &net, int blob_id);
+vector<bool> neededLayers(const Net<float> &net, int last_layer);
+void printReport(const Net<float> &net, const vector<LayerStats> &stats, const vector<double> &forward_seconds,
+    const vector<string> &blob_names, int batch_size);
+int writeCsv(const string &csv_file, const vector<LayerStats> &stats, double total_ms);
+
+int main(int argc, char **argv)
+{
+    ::google::InitGoogleLogging(argv[0]);
+    int num_batches = std::stoi(takeOption(argc, argv, "--batches", "20"));
+    int warmup = std::stoi(takeOption(argc, argv, "--warmup", "2"));
+    string weights = takeOption(argc, argv, "--weights", "");
+    string csv_file = takeOption(argc, argv, "--csv", "");
+    if(argc < 2 || argc > 3 || num_batches < 1 || warmup < 0)
+    {
+        LOG(ERROR) <<
+        "This program is used to profile the Forward pass of the feature extraction net layer by layer\n"
+        "用法：layerProfile [--batches N] [--warmup N] [--weights caffemodel] [--csv file] blob_names [net_protofile]\n"
+        "blob_names:要提取的特征对应的blob的名字，用逗号隔开，如pool10,fire9/concat\n"
+        "net_protofile:网络的proto txt文件，默认为源码目录中的squzzeNet.prototxt，batch大小由输入层决定\n"
+        "--batches N:统计N个batch的耗时，默认为20\n"
+        "--warmup N:统计前先运行N个batch，默认为2\n"
+        "--weights caffemodel:可选的训练好的参数，默认使用proto txt中的初始化方式，不影响计算量\n"
+        "--csv file:同时把每一层的结果写入file，每行为layer,type,ms_per_batch,stddev_ms,percent,cumulative_ms,top_bytes\n";
+        return 1;
+    }
+    vector<string> blob_names;
+    boost::split(blob_names, argv[1], boost::is_any_of(","));
+    string net_proto = argc > 2 ? argv[2] : LAYERPROFILE_DEFAULT_NET;
+
+    Caffe::set_mode(Caffe::CPU);
+    Net<float> net(net_proto, caffe::TEST);
+    if(!weights.empty())
+        net.CopyTrainedLayersFrom(weights);
+    for(const string &blob_name : blob_names)
+    {
+        if(!net.has_blob(blob_name))
+        {
+            LOG(ERROR) << "Unknown feature blob name " << blob_name << " in the network " << net_proto;
+            return 1;
+        }
+    }
+    //输入为固定的随机数据，各层的计算量和输入的内容无关
+    std::srand(2018);
+    for(caffe::Blob<float> *input : net.input_blobs())
+    {
+        float *data = input->mutable_cpu_data();
+        for(int i = 0; i < input->count(); ++i)
+            data[i] = std::rand() % 256;
+    }
+    const int batch_size = net.num_inputs() ? net.input_blobs()[0]->num() : 1;
+
+    vector<LayerStats> stats;
+    vector<double> forward_seconds;
+    profileLayers(net, num_batches, warmup, stats, forward_seconds);
+    printReport(net, stats, forward_seconds, blob_names, batch_size);
+    if(!csv_file.empty())
+    {
+        double total_ms = 0;
+        for(const LayerStats &layer : stats)
+            total_ms += layer.mean_ms;
+        return writeCsv(csv_file, stats, total_ms);
+    }
+    return 0;
+}
+
+//每个batch依次用ForwardFromTo(i, i)运行每一层并计时，同时测量整个Forward()作为对照
+void profileLayers(Net<float> &net, int num_batches, int warmup, vector<LayerStats> &stats, vector<double> &forward_seconds)
+{
+    const int num_layers = static_cast<int>(net.layers().size());
+    stats.assign(num_layers, LayerStats());
+    std::set<int> counted_blobs;
+    for(int i = 0; i < num_layers; ++i)
+    {
+        LayerStats &layer = stats[i];
+        layer.name = net.layer_names()[i];
+        layer.type = net.layers()[i]->type();
+        layer.top_bytes = 0;
+        const vector<int> &top_ids = net.top_ids(i);
+        for(size_t k = 0; k < top_ids.size(); ++k)
+        {
+            layer.tops += (k ? "," : "") + net.blob_names()[top_ids[k]];
+            //in-place的层(如ReLU)复用输入blob的内存，只在第一次产生该blob的层上计算
+            if(counted_blobs.insert(top_ids[k]).second)
+                layer.top_bytes += net.top_vecs()[i][k]->count() * sizeof(float);
+        }
+    }
+    for(int batch = 0; batch < warmup; ++batch)
+        net.Forward();
+    for(int batch = 0; batch < num_batches; ++batch)
+    {
+        for(int i = 0; i < num_layers; ++i)
+        {
+            Clock::time_point start = Clock::now();
+            net.ForwardFromTo(i, i);
+            stats[i].seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+        }
+        Clock::time_point start = Clock::now();
+        net.Forward();
+        forward_seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    for(LayerStats &layer : stats)
+    {
+        double sum = 0, square_sum = 0;
+        for(double s : layer.seconds)
+            sum += s;
+        layer.mean_ms = sum / num_batches * 1e3;
+        for(double s : layer.seconds)
+            square_sum += (s * 1e3 - layer.mean_ms) * (s * 1e3 - layer.mean_ms);
+        layer.stddev_ms = num_batches > 1 ? std::sqrt(square_sum / (num_batches - 1)) : 0;
+    }
+}
+
+//最后一个以blob_id为输出的层，in-place的层之后blob才是最终的值；输入blob返回-1
+int lastWriter(const Net<float> &net, int blob_id)
+{
+    int last = -1;
+    for(int i = 0; i < static_cast<int>(net.layers().size()); ++i)
+    {
+        const vector<int> &top_ids = net.top_ids(i);
+        if(std::find(top_ids.begin(), top_ids.end(), blob_id) != top_ids.end())
+            last = i;
+    }
+    return last;
+}
+
+//计算第last_layer层的输出需要执行的层：从last_layer向前，输出被需要的blob的层都需要执行，其输入也变为被需要的blob
+vector<bool> neededLayers(const Net<float> &net, int last_layer)
+{
+    vector<bool> needed(net.layers().size(), false);
+    if(last_layer < 0)
+        return needed;
+    std::set<int> required(net.top_ids(last_layer).begin(), net.top_ids(last_layer).end());
+    for(int i = last_layer; i >= 0; --i)
+    {
+        const vector<int> &top_ids = net.top_ids(i);
+        bool produces = i == last_layer;
+        for(int id : top_ids)
+            produces = produces || required.count(id);
+        if(!produces)
+            continue;
+        needed[i] = true;
+        const vector<int> &bottom_ids = net.bottom_ids(i);
+        required.insert(bottom_ids.begin(), bottom_ids.end());
+    }
+    return needed;
+}
+
+void printReport(const Net<float> &net, const vector<LayerStats> &stats, const vector<double> &forward_seconds,
+    const vector<string> &blob_names, int batch_size)
+{
+    double total_ms = 0;
+    size_t total_bytes = 0;
+    for(const LayerStats &layer : stats)
+    {
+        total_ms += layer.mean_ms;
+        total_bytes += layer.top_bytes;
+    }
+    double forward_ms = 0;
+    for(double s : forward_seconds)
+        forward_ms += s;
+    forward_ms = forward_ms / forward_seconds.size() * 1e3;
+
+    std::printf("batch size %d, %zu batches\n", batch_size, forward_seconds.size());
+    std::printf("%4s %-24s %-14s %10s %9s %7s %11s %12s  %s\n", "id", "layer", "type", "ms/batch", "stddev", "%",
+        "cumul. ms", "top bytes", "tops");
+    double cumulative_ms = 0;
+    for(size_t i = 0; i < stats.size(); ++i)
+    {
+        const LayerStats &layer = stats[i];
+        cumulative_ms += layer.mean_ms;
+        std::printf("%4zu %-24s %-14s %10.3f %9.3f %7.2f %11.3f %12zu  %s\n", i, layer.name.c_str(), layer.type.c_str(),
+            layer.mean_ms, layer.stddev_ms, total_ms > 0 ? 100 * layer.mean_ms / total_ms : 0, cumulative_ms,
+            layer.top_bytes, layer.tops.c_str());
+    }
+    std::printf("sum of layers %.3f ms/batch, Forward() %.3f ms/batch, activations %zu bytes (%zu bytes/frame)\n\n",
+        total_ms, forward_ms, total_bytes, total_bytes / batch_size);
+
+    //ForwardTo的代价是顺序执行到产生该blob的最后一层为止，只执行依赖的层时可以跳过其他分支
+    std::printf("%-20s %-24s %12s %7s %12s %7s %12s %12s\n", "blob", "last layer", "ForwardTo ms", "%", "needed ms", "%",
+        "blob bytes", "dim/frame");
+    for(const string &blob_name : blob_names)
+    {
+        const vector<string> &names = net.blob_names();
+        int blob_id = static_cast<int>(std::find(names.begin(), names.end(), blob_name) - names.begin());
+        int last = lastWriter(net, blob_id);
+        double prefix_ms = 0, needed_ms = 0;
+        vector<bool> needed = neededLayers(net, last);
+        for(int i = 0; i <= last; ++i)
+        {
+            prefix_ms += stats[i].mean_ms;
+            if(needed[i])
+                needed_ms += stats[i].mean_ms;
+        }
+        const int count = net.blob_by_name(blob_name)->count();
+        std::printf("%-20s %-24s %12.3f %7.2f %12.3f %7.2f %12zu %12d\n", blob_name.c_str(),
+            last >= 0 ? stats[last].name.c_str() : "(input)", prefix_ms, total_ms > 0 ? 100 * prefix_ms / total_ms : 0,
+            needed_ms, total_ms > 0 ? 100 * needed_ms / total_ms : 0, count * sizeof(float), count / batch_size);
+    }
+}
+
+//成功返回0，失败返回1
+int writeCsv(const string &csv_file, const vector<LayerStats> &stats, double total_ms)
+{
+    std::ofstream output(csv_file);
+    if(!output.is_open())
+    {
+        LOG(ERROR) << "cannot create the file " << csv_file;
+        return 1;
+    }
+    output << "layer,type,ms_per_batch,stddev_ms,percent,cumulative_ms,top_bytes\n";
+    double cumulative_ms = 0;
+    for(const LayerStats &layer : stats)
+    {
+        cumulative_ms += layer.mean_ms;
+        output << layer.name << "," << layer.type << "," << layer.mean_ms << "," << layer.stddev_ms << ","
+            << (total_ms > 0 ? 100 * layer.mean_ms / total_ms : 0) << "," << cumulative_ms << "," << layer.top_bytes << "\n";
+    }
+    return output.good() ? 0 : 1;
+}
@@ -0,0 +1,33 @@
+#include <glog/logging.h>
+
+#include "Options.hpp"
+
+string takeOption(int &argc, char **argv, const string &name, const string &default_value)
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        if(name != argv[i])
+            continue;
+        CHECK_LT(i + 1, argc) << "missing value for option " << name;
+        string value(argv[i + 1]);
+        for(int j = i + 2; j < argc; ++j)
+            argv[j - 2] = argv[j];
+        argc -= 2;
+        return value;
+    }
+    return default_value;
+}
+
+bool takeFlag(int &argc, char **argv, const string &name)
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        if(name != argv[i])
+            continue;
+        for(int j = i + 1; j < argc; ++j)
+            argv[j - 1] = argv[j];
+        --argc;
+        return true;
+    }
+    return false;
+}
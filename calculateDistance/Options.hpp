@@ -0,0 +1,17 @@
+/*
+**命令行中可选参数的解析，calculateDistance和各个工具共用*
+**可选参数可以出现在任意位置，取出后从argv中删除，剩下的是按位置排列的参数*
+*/
+#ifndef OPTIONS_HPP_
+#define OPTIONS_HPP_
+
+#include <string>
+
+using std::string;
+
+//从命令行参数中取出形如"name value"的可选参数，并将这两项从argv中删除
+//参数不存在时返回default_value
+string takeOption(int &argc, char **argv, const string &name, const string &default_value);
+//从命令行参数中取出开关参数name，存在时返回true
+bool takeFlag(int &argc, char **argv, const string &name);
+#endif
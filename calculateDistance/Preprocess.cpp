@@ -0,0 +1,101 @@
+#include <glog/logging.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+#include "Preprocess.hpp"
+
+//单行3通道数据的转换，一次处理16个像素：
+//v_load_deinterleave把BGRBGR...拆成三个通道，再依次扩展为u16、u32并转换为float，
+//每个通道的结果连续写入各自的平面，避免原来按通道跨步写入
+static void fillRowC3(const uchar *src, float *dst_b, float *dst_g, float *dst_r, int width,
+    const float *mean, float scale)
+{
+    int w = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_scale = cv::v_setall_f32(scale);
+    const cv::v_float32x4 v_mean[3] = {cv::v_setall_f32(mean[0]), cv::v_setall_f32(mean[1]), cv::v_setall_f32(mean[2])};
+    float *dst[3] = {dst_b, dst_g, dst_r};
+    for(; w + 16 <= width; w += 16)
+    {
+        cv::v_uint8x16 planes[3];
+        cv::v_load_deinterleave(src + w * 3, planes[0], planes[1], planes[2]);
+        for(int c = 0; c < 3; ++c)
+        {
+            cv::v_uint16x8 half[2];
+            cv::v_expand(planes[c], half[0], half[1]);
+            for(int k = 0; k < 2; ++k)
+            {
+                cv::v_uint32x4 quarter[2];
+                cv::v_expand(half[k], quarter[0], quarter[1]);
+                for(int q = 0; q < 2; ++q)
+                {
+                    cv::v_float32x4 v = cv::v_cvt_f32(cv::v_reinterpret_as_s32(quarter[q]));
+                    cv::v_store(dst[c] + w + k * 8 + q * 4, (v - v_mean[c]) * v_scale);
+                }
+            }
+        }
+    }
+#endif
+    for(; w < width; ++w)
+    {
+        dst_b[w] = (src[w * 3] - mean[0]) * scale;
+        dst_g[w] = (src[w * 3 + 1] - mean[1]) * scale;
+        dst_r[w] = (src[w * 3 + 2] - mean[2]) * scale;
+    }
+}
+
+void fillInputData(const cv::Mat &img, float *dst, const PreprocessParam &param)
+{
+    const int channels = param.channels, height = param.height, width = param.width;
+    CHECK_EQ(img.rows, height);
+    CHECK_EQ(img.cols, width);
+    CHECK_EQ(img.channels(), channels);
+    vector<float> zero_mean(channels, 0.0f);
+    const float *mean = param.mean.empty() ? zero_mean.data() : param.mean.data();
+    const int plane_size = height * width;
+    for(int h = 0; h < height; ++h)
+    {
+        const uchar *ptr = img.ptr<uchar>(h);
+        float *row = dst + h * width;
+        if(channels == 3)
+            fillRowC3(ptr, row, row + plane_size, row + 2 * plane_size, width, mean, param.scale);
+        else
+        {
+            for(int c = 0; c < channels; ++c)
+                for(int w = 0; w < width; ++w)
+                    row[c * plane_size + w] = (ptr[w * channels + c] - mean[c]) * param.scale;
+        }
+    }
+}
+
+//对一批帧中的每一帧并行地执行缩放和转换
+class PreprocessBody : public cv::ParallelLoopBody{
+public:
+    PreprocessBody(const vector<cv::Mat> &frames, vector<cv::Mat> &resized, float *dst, const PreprocessParam &param)
+        :m_frames(frames),m_resized(resized),m_dst(dst),m_param(param){}
+    virtual void operator()(const cv::Range &range) const
+    {
+        const int image_size = m_param.channels * m_param.height * m_param.width;
+        for(int j = range.start; j < range.end; ++j)
+        {
+            const cv::Mat *img = &m_frames[j];
+            if(img->rows != m_param.height || img->cols != m_param.width)
+            {
+                cv::resize(*img, m_resized[j], cv::Size(m_param.width, m_param.height));
+                img = &m_resized[j];
+            }
+            fillInputData(*img, m_dst + j * image_size, m_param);
+        }
+    }
+private:
+    const vector<cv::Mat> &m_frames;
+    vector<cv::Mat> &m_resized;
+    float *m_dst;
+    const PreprocessParam &m_param;
+};
+
+void preprocessFrames(const vector<cv::Mat> &frames, size_t num, vector<cv::Mat> &resized, float *dst, const PreprocessParam &param)
+{
+    CHECK_GE(resized.size(), num);
+    cv::parallel_for_(cv::Range(0, static_cast<int>(num)), PreprocessBody(frames, resized, dst, param));
+}
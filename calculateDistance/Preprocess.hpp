@@ -0,0 +1,27 @@
+/*
+**将解码得到的视频帧转换成网络的输入格式*
+**缩放到网络输入的大小，把交错存放的BGR通道拆成平面(HWC->CHW)，并转换为float，可选地减均值和缩放*
+*/
+#ifndef PREPROCESS_HPP_
+#define PREPROCESS_HPP_
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+using std::vector;
+
+//预处理的参数：dst = (src - mean[c]) * scale
+struct PreprocessParam{
+    PreprocessParam():scale(1.0f){}
+    int channels, height, width;
+    vector<float> mean;     //为空时不减均值
+    float scale;
+};
+
+//把8位图像img(大小必须等于param.height x param.width)转换为CHW格式的float数据，写入dst
+void fillInputData(const cv::Mat &img, float *dst, const PreprocessParam &param);
+
+//并行地处理frames中的前num帧，第j帧缩放后存放在resized[j]中(复用其内存)，转换结果写入dst + j * channels * height * width
+void preprocessFrames(const vector<cv::Mat> &frames, size_t num, vector<cv::Mat> &resized, float *dst, const PreprocessParam &param);
+#endif
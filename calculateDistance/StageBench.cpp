@@ -0,0 +1,524 @@
+/*
+**各个处理阶段的微基准测试*
+**覆盖解码、缩放和HWC->CHW转换、按层分组的Forward、Cosine距离的各种实现、带状矩阵和逐对计算的多采样率距离、*
+**过滤算法和多采样率的合并*
+**所有输入都是程序生成的(视频先写入临时文件)，不需要网络连接和真实数据，网络只使用proto txt的结构，参数可选*
+**每个测试重复多次，结果以JSON输出，包含每次迭代时间的均值、中位数、标准差、最小值、最大值和变异系数，*
+**用于比较Caffe、OpenCV等依赖升级前后的性能*
+*/
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <random>
+#include <thread>
+#include <utility>
+
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include "boost/algorithm/string.hpp"
+
+#include "caffe/net.hpp"
+#include "CalculateDistance.hpp"
+#include "DistanceKernels.hpp"
+#include "DistanceState.hpp"
+#include "FilterEngine.hpp"
+#include "Preprocess.hpp"
+#include "SyntheticVideo.hpp"
+#include "Options.hpp"
+#include "Json.hpp"
+
+#ifndef STAGEBENCH_DEFAULT_NET
+#define STAGEBENCH_DEFAULT_NET "squzzeNet.prototxt"
+#endif
+
+using std::string;
+using std::vector;
+using std::pair;
+using caffe::Caffe;
+using caffe::Net;
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchOptions{
+    int repetitions;        //每个测试重复的次数，统计量在各次重复之间计算
+    double min_time;        //每次重复至少运行的秒数，据此确定迭代次数
+    vector<string> only;    //只运行名字以其中某一项开头的测试，为空时运行全部
+};
+
+//一个测试的结果，时间的单位都是每次迭代的纳秒数
+struct BenchResult{
+    string name;
+    vector<pair<string,string>> params;
+    long long items_per_iteration;      //每次迭代处理的帧数、向量对数或序列长度
+    long long iterations;               //每次重复的迭代次数
+    vector<double> samples;             //每次重复测得的每次迭代时间
+    double mean, median, stddev, min, max;
+};
+
+bool selected(const BenchOptions &options, const string &name);
+bool groupSelected(const BenchOptions &options, const string &group);
+void summarize(BenchResult &result);
+void runBenchmark(const BenchOptions &options, const string &name, const vector<pair<string,string>> &params,
+    long long items_per_iteration, const std::function<void()> &body, vector<BenchResult> &results);
+void writeJson(std::ostream &out, const BenchOptions &options, const vector<BenchResult> &results);
+void benchDecode(const BenchOptions &options, const string &scratch_dir, int num_frames, vector<BenchResult> &results);
+void benchPreprocess(const BenchOptions &options, int channels, int height, int width, vector<BenchResult> &results);
+void benchForward(const BenchOptions &options, const string &net_proto, const string &weights, vector<BenchResult> &results);
+void benchCosine(const BenchOptions &options, vector<BenchResult> &results);
+void benchDistance(const BenchOptions &options, vector<BenchResult> &results);
+void syntheticDistances(int length, std::mt19937 &rng, vector<pair<int,float>> &distances);
+void benchFilter(const BenchOptions &options, vector<BenchResult> &results);
+void benchMerge(const BenchOptions &options, vector<BenchResult> &results);
+
+//防止被测的计算被编译器优化掉
+static volatile float g_sink = 0;
+
+int main(int argc, char **argv)
+{
+    ::google::InitGoogleLogging(argv[0]);
+    BenchOptions options;
+    options.repetitions = std::stoi(takeOption(argc, argv, "--repetitions", "10"));
+    options.min_time = std::stod(takeOption(argc, argv, "--min_time", "0.05"));
+    string only = takeOption(argc, argv, "--only", "");
+    if(!only.empty())
+        boost::split(options.only, only, boost::is_any_of(","));
+    string net_proto = takeOption(argc, argv, "--net", STAGEBENCH_DEFAULT_NET);
+    string weights = takeOption(argc, argv, "--weights", "");
+    string scratch_dir = takeOption(argc, argv, "--scratch_dir", "/tmp");
+    int num_frames = std::stoi(takeOption(argc, argv, "--frames", "240"));
+    string output_file = takeOption(argc, argv, "--output", "");
+    if(argc > 1 || options.repetitions < 2 || options.min_time <= 0 || num_frames < 1)
+    {
+        LOG(ERROR) <<
+        "This program is used to benchmark every stage of calculateDistance on synthetic inputs\n"
+        "用法：stageBench [--repetitions N] [--min_time s] [--only prefixes] [--net prototxt] [--weights caffemodel] [--scratch_dir dir] [--frames N] [--output file]\n"
+        "--repetitions N:每个测试重复N次(N >= 2)，默认为10\n"
+        "--min_time s:每次重复至少运行s秒，默认为0.05\n"
+        "--only prefixes:用逗号隔开的名字前缀，只运行名字以其中某一项开头的测试，如decode,filter/adaptive\n"
+        "--net prototxt:Forward测试使用的网络结构，默认为源码目录中的squzzeNet.prototxt\n"
+        "--weights caffemodel:可选的训练好的参数，默认使用proto txt中的初始化方式，不影响计算量\n"
+        "--scratch_dir dir:写入合成视频的临时目录，默认为/tmp\n"
+        "--frames N:合成视频的帧数，默认为240\n"
+        "--output file:JSON结果写入file，默认输出到标准输出\n";
+        return 1;
+    }
+    Caffe::set_mode(Caffe::CPU);
+
+    vector<BenchResult> results;
+    benchDecode(options, scratch_dir, num_frames, results);
+    benchPreprocess(options, 3, 227, 227, results);
+    benchForward(options, net_proto, weights, results);
+    benchCosine(options, results);
+    benchDistance(options, results);
+    benchFilter(options, results);
+    benchMerge(options, results);
+
+    if(output_file.empty())
+    {
+        writeJson(std::cout, options, results);
+        return 0;
+    }
+    std::ofstream output(output_file);
+    if(!output.is_open())
+    {
+        LOG(ERROR) << "cannot create the file " << output_file;
+        return 1;
+    }
+    writeJson(output, options, results);
+    return 0;
+}
+
+bool selected(const BenchOptions &options, const string &name)
+{
+    if(options.only.empty())
+        return true;
+    for(const string &prefix : options.only)
+    {
+        if(name.compare(0, prefix.size(), prefix) == 0)
+            return true;
+    }
+    return false;
+}
+
+//名字以group开头的测试中是否可能有被选中的，用于跳过准备代价较大的一组测试
+bool groupSelected(const BenchOptions &options, const string &group)
+{
+    if(selected(options, group))
+        return true;
+    for(const string &prefix : options.only)
+    {
+        if(prefix.compare(0, group.size(), group) == 0)
+            return true;
+    }
+    return false;
+}
+
+void summarize(BenchResult &result)
+{
+    vector<double> sorted(result.samples);
+    std::sort(sorted.begin(), sorted.end());
+    const size_t n = sorted.size();
+    result.min = sorted.front();
+    result.max = sorted.back();
+    result.median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    double sum = 0;
+    for(double x : sorted)
+        sum += x;
+    result.mean = sum / n;
+    double square_sum = 0;
+    for(double x : sorted)
+        square_sum += (x - result.mean) * (x - result.mean);
+    result.stddev = std::sqrt(square_sum / (n - 1));
+}
+
+//先运行一次预热并估计单次迭代的时间，确定每次重复的迭代次数，再重复options.repetitions次
+void runBenchmark(const BenchOptions &options, const string &name, const vector<pair<string,string>> &params,
+    long long items_per_iteration, const std::function<void()> &body, vector<BenchResult> &results)
+{
+    if(!selected(options, name))
+        return;
+    BenchResult result;
+    result.name = name;
+    result.params = params;
+    result.items_per_iteration = items_per_iteration;
+    Clock::time_point start = Clock::now();
+    body();
+    double once = std::chrono::duration<double>(Clock::now() - start).count();
+    result.iterations = std::max(1LL, static_cast<long long>(std::ceil(options.min_time / std::max(once, 1e-9))));
+    for(int r = 0; r < options.repetitions; ++r)
+    {
+        start = Clock::now();
+        for(long long i = 0; i < result.iterations; ++i)
+            body();
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        result.samples.push_back(elapsed * 1e9 / result.iterations);
+    }
+    summarize(result);
+    LOG(INFO) << name << ": " << result.median << " ns/iteration (cv " << result.stddev / result.mean << ")";
+    results.push_back(result);
+}
+
+void writeJson(std::ostream &out, const BenchOptions &options, const vector<BenchResult> &results)
+{
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    out.precision(6);
+    out << "{\n  \"context\": {\"date\": " << jsonString(date)
+        << ", \"num_cpus\": " << std::thread::hardware_concurrency()
+        << ", \"distance_kernels\": " << jsonString(distanceKernels().isa)
+        << ", \"opencv\": " << jsonString(CV_VERSION)
+        << ", \"repetitions\": " << options.repetitions
+        << ", \"min_time\": " << options.min_time << "},\n  \"benchmarks\": [";
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &result = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << jsonString(result.name) << ", \"params\": {";
+        for(size_t k = 0; k < result.params.size(); ++k)
+            out << (k ? ", " : "") << jsonString(result.params[k].first) << ": " << jsonString(result.params[k].second);
+        out << "}, \"items_per_iteration\": " << result.items_per_iteration
+            << ", \"iterations\": " << result.iterations
+            << ", \"ns_per_iteration\": {\"mean\": " << result.mean << ", \"median\": " << result.median
+            << ", \"stddev\": " << result.stddev << ", \"min\": " << result.min << ", \"max\": " << result.max
+            << ", \"cv\": " << result.stddev / result.mean << "}"
+            << ", \"ns_per_item\": " << result.median / result.items_per_iteration
+            << ", \"samples\": [";
+        for(size_t k = 0; k < result.samples.size(); ++k)
+            out << (k ? ", " : "") << result.samples[k];
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+//每次迭代打开视频并读取所有帧
+void benchDecode(const BenchOptions &options, const string &scratch_dir, int num_frames, vector<BenchResult> &results)
+{
+    const int heights[] = {360, 720}, widths[] = {640, 1280};
+    for(int k = 0; k < 2; ++k)
+    {
+        string name = "decode/" + std::to_string(widths[k]) + "x" + std::to_string(heights[k]);
+        if(!selected(options, name))
+            continue;
+        string video_file = scratch_dir + "/stageBench_" + std::to_string(widths[k]) + "x" + std::to_string(heights[k]) + ".avi";
+        //每30帧一个镜头
+        vector<int> cuts;
+        for(int cut = 30; cut < num_frames; cut += 30)
+            cuts.push_back(cut);
+        if(writeSyntheticVideo(video_file, num_frames, heights[k], widths[k], cuts))
+            continue;
+        cv::Mat frame;
+        runBenchmark(options, name, {{"codec", "MJPG"}, {"height", std::to_string(heights[k])},
+            {"width", std::to_string(widths[k])}}, num_frames, [&]{
+            cv::VideoCapture cap(video_file);
+            CHECK(cap.isOpened()) << "cannot open the video " << video_file;
+            int frames = 0;
+            while(cap.read(frame))
+                ++frames;
+            CHECK_EQ(frames, num_frames) << "cannot decode all frames of " << video_file;
+        }, results);
+        std::remove(video_file.c_str());
+    }
+}
+
+//缩放到网络输入大小并转换为CHW的float数据，分别测量单线程的fillInputData和FeatureExtractor使用的preprocessFrames
+void benchPreprocess(const BenchOptions &options, int channels, int height, int width, vector<BenchResult> &results)
+{
+    if(!groupSelected(options, "preprocess/"))
+        return;
+    PreprocessParam param;
+    param.channels = channels;
+    param.height = height;
+    param.width = width;
+    param.mean = {104.0f, 117.0f, 123.0f};
+    const int batch_size = 10;
+    vector<cv::Mat> frames(batch_size), resized(batch_size);
+    cv::RNG rng(2018);
+    for(auto &frame : frames)
+    {
+        frame.create(360, 640, CV_8UC3);
+        rng.fill(frame, cv::RNG::UNIFORM, 0, 256);
+    }
+    const size_t input_size = static_cast<size_t>(channels) * height * width;
+    vector<float> input(input_size * batch_size);
+    vector<pair<string,string>> params = {{"src", "640x360"}, {"dst", std::to_string(width) + "x" + std::to_string(height)}};
+    cv::Mat img;
+    cv::resize(frames[0], img, cv::Size(width, height));
+    runBenchmark(options, "preprocess/fill", params, 1, [&]{
+        fillInputData(img, input.data(), param);
+    }, results);
+    runBenchmark(options, "preprocess/resize_fill", params, 1, [&]{
+        cv::resize(frames[0], img, cv::Size(width, height));
+        fillInputData(img, input.data(), param);
+    }, results);
+    params.push_back({"batch", std::to_string(batch_size)});
+    runBenchmark(options, "preprocess/batch", params, batch_size, [&]{
+        preprocessFrames(frames, batch_size, resized, input.data(), param);
+    }, results);
+}
+
+//把网络按Pooling层分成若干组，用ForwardFromTo分别测量每一组，以及整个Forward
+void benchForward(const BenchOptions &options, const string &net_proto, const string &weights, vector<BenchResult> &results)
+{
+    if(!groupSelected(options, "forward/"))
+        return;
+    Net<float> net(net_proto, caffe::TEST);
+    if(!weights.empty())
+        net.CopyTrainedLayersFrom(weights);
+    cv::RNG rng(2018);
+    for(int i = 0; i < net.num_inputs(); ++i)
+    {
+        caffe::Blob<float> *input = net.input_blobs()[i];
+        cv::Mat data(1, input->count(), CV_32F, input->mutable_cpu_data());
+        rng.fill(data, cv::RNG::UNIFORM, 0.0f, 255.0f);
+    }
+    const int batch_size = net.num_inputs() ? net.input_blobs()[0]->num() : 1;
+    const vector<string> &layer_names = net.layer_names();
+    const int num_layers = static_cast<int>(layer_names.size());
+    int start = 0;
+    for(int i = 0; i < num_layers; ++i)
+    {
+        if(i + 1 < num_layers && string(net.layers()[i]->type()) != "Pooling")
+            continue;
+        string name = "forward/" + layer_names[start] + ".." + layer_names[i];
+        runBenchmark(options, name, {{"net", net_proto}, {"first_layer", std::to_string(start)},
+            {"last_layer", std::to_string(i)}, {"batch", std::to_string(batch_size)}}, batch_size, [&, start, i]{
+            net.ForwardFromTo(start, i);
+        }, results);
+        start = i + 1;
+    }
+    runBenchmark(options, "forward/all", {{"net", net_proto}, {"batch", std::to_string(batch_size)}}, batch_size, [&]{
+        net.Forward();
+    }, results);
+}
+
+//SqueezeNet中prob的1000维和conv10的13x13x1000维特征上的Cosine距离：
+//每次计算范数的CosineDistance、归一化后的点积、calculate_batch，以及直接调用分派的核函数
+void benchCosine(const BenchOptions &options, vector<BenchResult> &results)
+{
+    if(!groupSelected(options, "cosine/"))
+        return;
+    const int dims[] = {1000, 169000};
+    const int num_vectors = 65;
+    std::mt19937 rng(2018);
+    std::uniform_real_distribution<float> value(0.0f, 1.0f);
+    CosineDistance<float> cosine;
+    shared_ptr<CalculateDistance<float>> normalized = cosine.normalizedCalculator();
+    DistanceKernel kernel = distanceKernels().generic[kCosine];
+    for(int dim : dims)
+    {
+        vector<float> data(static_cast<size_t>(num_vectors) * dim);
+        for(auto &x : data)
+            x = value(rng);
+        vector<float> normalized_data(data);
+        normalizeRows(normalized_data.data(), num_vectors, dim);
+        //相邻向量组成的num_vectors - 1个向量对
+        vector<pair<int,int>> pairs;
+        for(int i = 0; i + 1 < num_vectors; ++i)
+            pairs.push_back(std::make_pair(i, i + 1));
+        const int num_pairs = static_cast<int>(pairs.size());
+        vector<float> distances(num_pairs);
+        vector<pair<string,string>> params = {{"dim", std::to_string(dim)}, {"pairs", std::to_string(num_pairs)}};
+        string suffix = "/" + std::to_string(dim);
+        runBenchmark(options, "cosine/calculate" + suffix, params, num_pairs, [&]{
+            for(const auto &p : pairs)
+                g_sink = g_sink + cosine.calculate(data.data() + static_cast<size_t>(p.first) * dim,
+                    data.data() + static_cast<size_t>(p.second) * dim, dim);
+        }, results);
+        runBenchmark(options, "cosine/normalized" + suffix, params, num_pairs, [&]{
+            for(const auto &p : pairs)
+                g_sink = g_sink + normalized->calculate(normalized_data.data() + static_cast<size_t>(p.first) * dim,
+                    normalized_data.data() + static_cast<size_t>(p.second) * dim, dim);
+        }, results);
+        runBenchmark(options, "cosine/calculate_batch" + suffix, params, num_pairs, [&]{
+            cosine.calculate_batch(data.data(), dim, pairs.data(), num_pairs, dim, distances.data());
+        }, results);
+        runBenchmark(options, "cosine/normalized_batch" + suffix, params, num_pairs, [&]{
+            normalized->calculate_batch(normalized_data.data(), dim, pairs.data(), num_pairs, dim, distances.data());
+        }, results);
+        params.push_back({"isa", distanceKernels().isa});
+        runBenchmark(options, "cosine/kernel" + suffix, params, num_pairs, [&]{
+            for(const auto &p : pairs)
+                g_sink = g_sink + kernel(data.data() + static_cast<size_t>(p.first) * dim,
+                    data.data() + static_cast<size_t>(p.second) * dim, dim);
+        }, results);
+    }
+}
+
+//一个batch(10帧，和squzzeNet.prototxt的输入相同)在多个采样率上的Cosine距离：
+//pairs为对每个采样率上的帧对调用一次calculate_batch，state为calculateDistance实际运行的DistanceState::update
+void benchDistance(const BenchOptions &options, vector<BenchResult> &results)
+{
+    if(!groupSelected(options, "distance/"))
+        return;
+    const char *rate_lists[] = {"1", "1,2", "1,2,4", "1,2,4,8", "1,2,4,8,16,32"};
+    const int dims[] = {1000, 86528};   //pool10和fire9/concat
+    const int batch_size = 10;
+    std::mt19937 rng(2018);
+    std::uniform_real_distribution<float> value(0.0f, 1.0f);
+    for(const char *rate_list : rate_lists)
+    {
+        vector<string> items;
+        boost::split(items, rate_list, boost::is_any_of(","));
+        vector<int> rates;
+        for(const string &item : items)
+            rates.push_back(std::stoi(item));
+        const int max_rate = rates.back();
+        for(int dim : dims)
+        {
+            //[之前的max_rate帧 | 当前batch]
+            vector<float> data(static_cast<size_t>(max_rate + batch_size) * dim);
+            for(auto &x : data)
+                x = value(rng);
+            const float *batch_data = data.data() + static_cast<size_t>(max_rate) * dim;
+            //batch中每一帧在每个采样率上和之前第rate帧比较(所有采样率都整除batch的第一帧的序号)
+            vector<pair<int,int>> pairs;
+            for(int j = 0; j < batch_size; ++j)
+            {
+                for(int rate : rates)
+                {
+                    if(j % rate == 0)
+                        pairs.push_back(std::make_pair(max_rate + j - rate, max_rate + j));
+                }
+            }
+            const int num_pairs = static_cast<int>(pairs.size());
+            vector<pair<string,string>> params = {{"rates", rate_list}, {"dim", std::to_string(dim)},
+                {"batch", std::to_string(batch_size)}, {"pairs", std::to_string(num_pairs)}};
+            string suffix = string("/") + rate_list + "/" + std::to_string(dim);
+
+            CosineDistance<float> cosine;
+            vector<float> distances(num_pairs);
+            runBenchmark(options, "distance/pairs" + suffix, params, batch_size, [&]{
+                cosine.calculate_batch(data.data(), dim, pairs.data(), num_pairs, dim, distances.data());
+            }, results);
+
+            DistanceState state("Cosine", rates, vector<int>(1, dim));
+            FeatureBatch batch;
+            batch.features.assign(1, vector<float>(batch_data, batch_data + static_cast<size_t>(batch_size) * dim));
+            batch.frame_nos.resize(batch_size);
+            int first_frame = 0;
+            runBenchmark(options, "distance/state" + suffix, params, batch_size, [&]{
+                //定期清空，距离序列不会无限增长
+                if(first_frame >= 100000)
+                {
+                    state.reset();
+                    first_frame = 0;
+                }
+                for(int j = 0; j < batch_size; ++j)
+                    batch.frame_nos[j] = first_frame + j;
+                state.update(batch);
+                first_frame += batch_size;
+            }, results);
+        }
+    }
+}
+
+//合成的距离序列：镜头内是小的噪声，平均每100帧有一个突变
+void syntheticDistances(int length, std::mt19937 &rng, vector<pair<int,float>> &distances)
+{
+    std::uniform_real_distribution<float> noise(0.0f, 0.05f), cut(0.3f, 1.0f), position(0.0f, 1.0f);
+    distances.resize(length);
+    for(int i = 0; i < length; ++i)
+        distances[i] = std::make_pair(i, position(rng) < 0.01f ? cut(rng) : noise(rng));
+}
+
+//两种过滤公式在1k到1M帧的序列上的时间，包含前缀和的计算
+void benchFilter(const BenchOptions &options, vector<BenchResult> &results)
+{
+    const int lengths[] = {1000, 10000, 100000, 1000000};
+    const FilterParam params[] = {FilterParam::adaptive(0.7f, 16), FilterParam::fixed(0.5f, 0.05f, 16)};
+    const char *names[] = {"adaptive", "static"};
+    std::mt19937 rng(2018);
+    vector<pair<int,float>> distances;
+    vector<int> candidates;
+    FilterEngine engine;
+    for(int length : lengths)
+    {
+        syntheticDistances(length, rng, distances);
+        for(int k = 0; k < 2; ++k)
+        {
+            runBenchmark(options, string("filter/") + names[k] + "/" + std::to_string(length),
+                {{"length", std::to_string(length)}, {"window_size", std::to_string(params[k].window_size)}}, length, [&]{
+                engine.setDistances(distances);
+                engine.filter(params[k], candidates);
+            }, results);
+        }
+    }
+}
+
+//合并3个采样率上的candidate，每个采样率的candidate数为帧数的1%
+void benchMerge(const BenchOptions &options, vector<BenchResult> &results)
+{
+    const int lengths[] = {10000, 100000, 1000000};
+    const int num_rates = 3;
+    const int min_space = 5;
+    std::mt19937 rng(2018);
+    vector<int> merged;
+    for(int length : lengths)
+    {
+        std::uniform_int_distribution<int> frame(0, length - 1);
+        vector<vector<int>> candidates(num_rates);
+        long long total = 0;
+        for(auto &rate_candidates : candidates)
+        {
+            for(int i = 0; i < length / 100; ++i)
+                rate_candidates.push_back(frame(rng));
+            std::sort(rate_candidates.begin(), rate_candidates.end());
+            rate_candidates.erase(std::unique(rate_candidates.begin(), rate_candidates.end()), rate_candidates.end());
+            total += rate_candidates.size();
+        }
+        runBenchmark(options, "merge/" + std::to_string(length), {{"frames", std::to_string(length)},
+            {"rates", std::to_string(num_rates)}, {"min_space", std::to_string(min_space)}}, total, [&]{
+            mergeCandidates(candidates, min_space, merged);
+        }, results);
+    }
+}
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <fstream>
+
+#include <glog/logging.h>
+
+#include "StageProfile.hpp"
+#include "Json.hpp"
+
+const char* profileStageName(ProfileStage stage)
+{
+    static const char *names[kNumProfileStages] = {"decode", "preprocess", "forward", "distance", "filter", "merge", "output"};
+    return names[stage];
+}
+
+StageProfile::StageProfile()
+{
+    start();
+}
+
+void StageProfile::start()
+{
+    m_start = Clock::now();
+    for(int i = 0; i < kNumProfileStages; ++i)
+    {
+        m_nanoseconds[i] = 0;
+        m_calls[i] = 0;
+    }
+    m_decoded_frames = 0;
+    m_extracted_frames = 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_batch_latencies.clear();
+}
+
+void StageProfile::addTime(ProfileStage stage, Clock::duration elapsed)
+{
+    m_nanoseconds[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    ++m_calls[stage];
+}
+
+void StageProfile::addFrames(int decoded, int extracted)
+{
+    m_decoded_frames += decoded;
+    m_extracted_frames += extracted;
+}
+
+void StageProfile::addBatchLatency(Clock::time_point decode_begin)
+{
+    double latency = std::chrono::duration<double>(Clock::now() - decode_begin).count();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_batch_latencies.push_back(latency);
+}
+
+//已排序的values的p分位数(最近秩)
+static double percentile(const vector<double> &values, double p)
+{
+    if(values.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(p * values.size() + 0.5);
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+int StageProfile::writeReport(const string &report_file, const string &video_file) const
+{
+    const double wall_seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+    vector<double> latencies;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        latencies = m_batch_latencies;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::ofstream output(report_file);
+    if(!output.is_open())
+    {
+        LOG(ERROR) << "cannot create the file " << report_file;
+        return 1;
+    }
+    const long long decoded = m_decoded_frames, extracted = m_extracted_frames;
+    output.precision(6);
+    output << "{\n  \"video\": " << jsonString(video_file) << ",\n  \"frames_decoded\": " << decoded
+        << ",\n  \"frames_extracted\": " << extracted << ",\n  \"seconds\": " << wall_seconds
+        << ",\n  \"fps\": " << (wall_seconds > 0 ? decoded / wall_seconds : 0) << ",\n  \"stages\": {";
+    //占比相对于处理的总时间，流水线各阶段并行运行，占比最大的阶段就是瓶颈
+    for(int i = 0; i < kNumProfileStages; ++i)
+    {
+        double seconds = m_nanoseconds[i] * 1e-9;
+        output << (i ? "," : "") << "\n    \"" << profileStageName(static_cast<ProfileStage>(i)) << "\": {\"seconds\": "
+            << seconds << ", \"calls\": " << m_calls[i] << ", \"share\": " << (wall_seconds > 0 ? seconds / wall_seconds : 0) << "}";
+    }
+    output << "\n  },\n  \"batch_latency\": {\"batches\": " << latencies.size()
+        << ", \"p50\": " << percentile(latencies, 0.5) << ", \"p90\": " << percentile(latencies, 0.9)
+        << ", \"p99\": " << percentile(latencies, 0.99) << ", \"max\": " << (latencies.empty() ? 0 : latencies.back()) << "}\n}\n";
+    return output.good() ? 0 : 1;
+}
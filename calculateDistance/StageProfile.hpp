@@ -0,0 +1,78 @@
+/*
+**单个视频处理过程中各阶段的计时和计数*
+**ScopedTimer在作用域结束时把经过的时间累加到对应的阶段，profile为nullptr时不计时，关闭报告时没有额外开销*
+**各阶段运行在流水线的不同线程上，累加使用原子操作；分段并行处理时，各阶段的时间是所有线程上的累计时间*
+*/
+#ifndef STAGEPROFILE_HPP_
+#define STAGEPROFILE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+enum ProfileStage{
+    kDecodeStage,       //解码，包括跳过不需要的帧
+    kPreprocessStage,   //缩放和HWC->CHW转换
+    kForwardStage,      //网络的前向计算和特征的拷贝
+    kDistanceStage,     //距离计算，流式处理时包括在线的过滤和合并
+    kFilterStage,       //各采样率上的过滤算法
+    kMergeStage,        //合并不同采样率的candidate
+    kOutputStage,       //写入candidate、距离序列和特征缓存
+    kNumProfileStages
+};
+
+const char* profileStageName(ProfileStage stage);
+
+class StageProfile{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    StageProfile();
+    //清空所有统计，并把当前时间作为处理开始的时间
+    void start();
+    void addTime(ProfileStage stage, Clock::duration elapsed);
+    void addTime(ProfileStage stage, Clock::time_point begin) {addTime(stage, Clock::now() - begin);}
+    //decoded: 解码(包括跳过)的帧数，extracted: 提取了特征的帧数
+    void addFrames(int decoded, int extracted);
+    //一个batch从开始解码到距离计算完成的时间
+    void addBatchLatency(Clock::time_point decode_begin);
+    //把报告写入report_file，处理的总时间到调用时为止
+    //成功返回0，失败返回1
+    int writeReport(const string &report_file, const string &video_file) const;
+private:
+    Clock::time_point m_start;
+    std::atomic<long long> m_nanoseconds[kNumProfileStages];
+    std::atomic<long long> m_calls[kNumProfileStages];
+    std::atomic<long long> m_decoded_frames;
+    std::atomic<long long> m_extracted_frames;
+    mutable std::mutex m_mutex;
+    vector<double> m_batch_latencies;   //秒
+};
+
+//在作用域结束时把经过的时间累加到profile的stage阶段
+class ScopedTimer{
+public:
+    ScopedTimer(StageProfile *profile, ProfileStage stage):m_profile(profile),m_stage(stage)
+    {
+        if(m_profile != nullptr)
+            m_begin = StageProfile::Clock::now();
+    }
+    ~ScopedTimer()
+    {
+        if(m_profile != nullptr)
+            m_profile->addTime(m_stage, m_begin);
+    }
+private:
+    ScopedTimer(const ScopedTimer&);
+    ScopedTimer& operator=(const ScopedTimer&);
+
+    StageProfile *m_profile;
+    ProfileStage m_stage;
+    StageProfile::Clock::time_point m_begin;
+};
+#endif
@@ -0,0 +1,164 @@
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "StreamingDetector.hpp"
+
+StreamingDetector::StreamingDetector(const string &distance_type, const vector<int> &all_rates, int dim,
+    std::function<void(int)> on_candidate, float a, int window_size, int min_space)
+    :m_rates(all_rates),m_dim(dim),m_on_candidate(on_candidate),m_a(a),m_window_size(window_size),m_min_space(min_space)
+{
+    CHECK_GE(window_size, 2) << "the window size must >= 2";
+    if(!distance_type.empty())
+    {
+        m_calculator = CreateCalculator<float>().create(distance_type);
+        CHECK(m_calculator) << "Unknown distance type " << distance_type;
+    }
+    m_filters.resize(all_rates.size());
+    for(auto &filter : m_filters)
+    {
+        filter.window.resize(2 * window_size - 1);
+        filter.last_feature.resize(dim);
+    }
+    reset();
+}
+
+void StreamingDetector::reset()
+{
+    for(auto &filter : m_filters)
+    {
+        filter.head = filter.size = 0;
+        filter.window_sum = filter.window_square_sum = 0.0;
+        filter.total_sum = 0.0;
+        filter.total_count = 0;
+        filter.decided = 0;
+        filter.pending.clear();
+        filter.accepted.clear();
+        filter.last_frame = -1;
+    }
+    m_ready.clear();
+}
+
+void StreamingDetector::pushFrame(int frame_no, const float *feature)
+{
+    CHECK(m_calculator) << "pushFrame needs a distance type";
+    for(size_t rate_index = 0; rate_index < m_rates.size(); ++rate_index)
+    {
+        //和离线算法一样，只比较序号为采样率整数倍的相邻采样帧
+        if(frame_no % m_rates[rate_index] != 0)
+            continue;
+        RateFilter &filter = m_filters[rate_index];
+        if(filter.last_frame >= 0 && filter.last_frame == frame_no - m_rates[rate_index])
+        {
+            float distance = m_calculator->calculate(filter.last_feature.data(), feature, m_dim);
+            pushDistance(rate_index, filter.last_frame, distance);
+        }
+        std::copy(feature, feature + m_dim, filter.last_feature.begin());
+        filter.last_frame = frame_no;
+    }
+}
+
+void StreamingDetector::pushDistance(size_t rate_index, int frame_no, float distance)
+{
+    RateFilter &filter = m_filters[rate_index];
+    const size_t capacity = filter.window.size();
+    filter.total_sum += distance;
+    ++filter.total_count;
+    if(filter.size == capacity)
+    {
+        //滑动窗口
+        float oldest = filter.window[filter.head].second;
+        filter.window_sum -= oldest;
+        filter.window_square_sum -= static_cast<double>(oldest) * oldest;
+        filter.head = (filter.head + 1) % capacity;
+        --filter.size;
+    }
+    filter.window[(filter.head + filter.size) % capacity] = std::make_pair(frame_no, distance);
+    ++filter.size;
+    filter.window_sum += distance;
+    filter.window_square_sum += static_cast<double>(distance) * distance;
+
+    if(filter.total_count < m_window_size)
+        filter.decided = frame_no + 1;  //前window_size-1个距离不会成为candidate
+    else if(filter.size == capacity)
+        evaluateCenter(filter);
+    mergeCandidates();
+}
+
+//窗口已满时判断窗口中心的帧是否是candidate
+//T = local_mean + a * local_sigma * (1 + ln(global_mean / local_mean))
+//当d(i) > T 或者 d(i)比其相邻的大很多时，认为该帧是candidate
+void StreamingDetector::evaluateCenter(RateFilter &filter)
+{
+    const size_t capacity = filter.window.size();
+    const double n = 2 * m_window_size - 1;
+    double local_mean = filter.window_sum / n;
+    double local_d = filter.window_square_sum - 2 * local_mean * filter.window_sum + n * local_mean * local_mean;
+    local_d = std::sqrt(std::max(local_d, 0.0) / (2 * m_window_size - 2));
+    double global_mean = filter.total_sum / filter.total_count;
+    double threshold = local_mean + m_a * local_d * (1 + std::log(global_mean / local_mean));
+
+    size_t center = (filter.head + m_window_size - 1) % capacity;
+    float prev = filter.window[(center + capacity - 1) % capacity].second;
+    float next = filter.window[(center + 1) % capacity].second;
+    const pair<int,float> &item = filter.window[center];
+    if(item.second > threshold
+        || ((item.second > 3 * prev || item.second > 3 * next) && item.second > 0.8 * global_mean))
+        filter.pending.push_back(item.first);
+    filter.decided = item.first + 1;
+}
+
+//在线地执行merge_candidates：第i个采样率上的candidate c只有在所有更低的采样率都已经确定了
+//c + min_space之前的candidate之后才能被判断，如果它和更低采样率保留的candidate相隔太近，则丢弃
+void StreamingDetector::mergeCandidates()
+{
+    long long lower_decided = LLONG_MAX;
+    for(size_t i = 0; i < m_filters.size(); ++i)
+    {
+        RateFilter &filter = m_filters[i];
+        while(!filter.pending.empty())
+        {
+            int candidate = filter.pending.front();
+            if(i > 0 && static_cast<long long>(candidate) + m_min_space > lower_decided)
+                break;
+            bool keep = true;
+            for(size_t j = 0; j < i && keep; ++j)
+            {
+                const std::deque<int> &accepted = m_filters[j].accepted;
+                auto it = std::lower_bound(accepted.begin(), accepted.end(), candidate - m_min_space + 1);
+                if(it != accepted.end() && *it < candidate + m_min_space)
+                    keep = false;
+            }
+            if(keep)
+            {
+                filter.accepted.push_back(candidate);
+                m_ready.insert(candidate);
+            }
+            filter.pending.pop_front();
+        }
+        long long merged = filter.pending.empty() ? filter.decided : filter.pending.front();
+        lower_decided = std::min(lower_decided, merged);
+    }
+    //所有采样率都已经确定的candidate可以按顺序输出
+    while(!m_ready.empty() && *m_ready.begin() < lower_decided)
+    {
+        m_on_candidate(*m_ready.begin());
+        m_ready.erase(m_ready.begin());
+    }
+    //之后的candidate不会再和这些candidate比较，释放它们
+    for(auto &filter : m_filters)
+    {
+        while(!filter.accepted.empty() && filter.accepted.front() <= lower_decided - m_min_space)
+            filter.accepted.pop_front();
+    }
+}
+
+void StreamingDetector::finish()
+{
+    //窗口尾部不足window_size的距离不会成为candidate
+    for(auto &filter : m_filters)
+        filter.decided = INT_MAX;
+    mergeCandidates();
+}
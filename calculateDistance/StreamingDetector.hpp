@@ -0,0 +1,70 @@
+/*
+**流式的candidate检测，用于直播等无法预先得到整个距离序列的场景*
+**逐帧(或逐个距离)输入，每个采样率上的过滤算法只保存大小为2*window_size-1的滑动窗口，*
+**全局均值用到目前为止所有距离的均值代替，不同采样率的candidate在有限的延迟内在线合并*
+**内存占用与视频长度无关，candidate的输出延迟由窗口大小决定*
+*/
+#ifndef STREAMINGDETECTOR_HPP_
+#define STREAMINGDETECTOR_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <functional>
+#include <utility>
+
+#include "CalculateDistance.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::shared_ptr;
+
+class StreamingDetector{
+public:
+    //distance_type: 距离度量的类型，只使用pushDistance时可以为空
+    //all_rates: 递增的采样率序列
+    //dim: 特征的维度，只使用pushDistance时可以为0
+    //on_candidate: 每确定一个candidate就以其帧序号调用一次，帧序号是递增的
+    //a, window_size: 过滤算法的参数，含义同filtering()
+    //min_space: 不同采样率之间的候选帧之间的最小间隔，含义同merge_candidates()
+    StreamingDetector(const string &distance_type, const vector<int> &all_rates, int dim,
+        std::function<void(int)> on_candidate, float a = 0.7, int window_size = 16, int min_space = 5);
+    ~StreamingDetector(){}
+    //输入一帧的特征，帧序号必须递增，可以跳过不被任何采样率使用的帧
+    void pushFrame(int frame_no, const float *feature);
+    //输入第rate_index个采样率上的一个距离，frame_no为参与比较的第一帧，同一采样率上的帧序号必须递增
+    void pushDistance(size_t rate_index, int frame_no, float distance);
+    void finish();  //输入结束，输出剩下的所有candidate
+    void reset();   //开始处理新的视频
+private:
+    //单个采样率上的在线过滤状态
+    struct RateFilter{
+        vector<pair<int,float>> window;     //环形缓冲区，保存最近的2*window_size-1个(帧序号，距离)
+        size_t head, size;
+        double window_sum, window_square_sum;
+        double total_sum;
+        long long total_count;
+        int decided;    //帧序号小于decided的candidate都已经被过滤算法确定
+        std::deque<int> pending;    //过滤算法已确定、但还没有被合并的candidate
+        std::deque<int> accepted;   //合并时保留下来的candidate，供更高采样率的candidate检查间隔
+        //最近一次参与比较的帧的特征，供pushFrame使用
+        vector<float> last_feature;
+        int last_frame;
+    };
+    void evaluateCenter(RateFilter &filter);
+    void mergeCandidates();
+
+    shared_ptr<CalculateDistance<float>> m_calculator;
+    vector<int> m_rates;
+    int m_dim;
+    std::function<void(int)> m_on_candidate;
+    float m_a;
+    int m_window_size;
+    int m_min_space;
+    vector<RateFilter> m_filters;
+    std::multiset<int> m_ready;     //已经合并、等待按顺序输出的candidate
+};
+#endif
@@ -0,0 +1,421 @@
+/*
+**过滤参数的网格搜索*
+**读取calculateDistance --save_distances保存的距离序列和人工标注的镜头边界，对a、window_size和min_space的每一组取值*
+**执行和calculateDistance相同的过滤算法和多采样率合并，输出每组参数的precision、recall和F1*
+**局部均值和方差由FilterEngine的前缀和得到，每个窗口大小的代价都是O(n)；阈值对a是线性的，每个窗口大小只求一次每帧被选中时a的范围，*
+**之后每组参数只需要遍历候选帧。多个视频由多个线程并行处理*
+*/
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "FilterEngine.hpp"
+#include "Options.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+
+//一个镜头边界所在的帧区间[begin, end]，突变时begin == end
+struct Transition{
+    int begin;
+    int end;
+};
+
+//一个采样率上的距离序列，每一项为(帧序号，距离)
+struct RateDistances{
+    int rate;
+    vector<pair<int,float>> distances;
+};
+
+//filtering中的一帧在a属于(low, high)时被选为candidate
+struct CandidateRange{
+    int frame_no;
+    double low;
+    double high;
+};
+
+struct Counts{
+    long long tp;
+    long long fp;
+    long long fn;
+};
+
+//要搜索的参数网格
+struct Grid{
+    vector<double> a;
+    vector<int> window_sizes;
+    vector<int> min_spaces;
+    int tolerance;      //candidate和标注区间之间允许的帧数误差
+    size_t size() const {return a.size() * window_sizes.size() * min_spaces.size();}
+    size_t index(size_t a_index, size_t window_index, size_t space_index) const
+    {
+        return (a_index * window_sizes.size() + window_index) * min_spaces.size() + space_index;
+    }
+};
+
+vector<double> parseValues(const string &spec);
+int loadDistances(const string &file_name, vector<RateDistances> &all_rates);
+int loadTransitions(const string &file_name, vector<Transition> &transitions);
+void candidateRanges(const vector<pair<int,float>> &distances, const FilterEngine &engine, int window_size,
+    double a_min, double a_max, vector<CandidateRange> &ranges);
+void matchTransitions(const vector<int> &candidates, const vector<Transition> &transitions, int tolerance, Counts &counts);
+void evaluateVideo(const vector<RateDistances> &all_rates, const vector<Transition> &transitions, const Grid &grid,
+    vector<Counts> &counts);
+string videoName(const string &video_file);
+
+int main(int argc, char **argv)
+{
+    ::google::InitGoogleLogging(argv[0]);
+    Grid grid;
+    grid.a = parseValues(takeOption(argc, argv, "--a", "0.1:2:0.1"));
+    for(double value : parseValues(takeOption(argc, argv, "--window_size", "4:32:2")))
+        grid.window_sizes.push_back(static_cast<int>(value));
+    for(double value : parseValues(takeOption(argc, argv, "--min_space", "0:20:5")))
+        grid.min_spaces.push_back(static_cast<int>(value));
+    grid.tolerance = std::stoi(takeOption(argc, argv, "--tolerance", "5"));
+    int num_threads = std::stoi(takeOption(argc, argv, "--threads", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+    string output_file = takeOption(argc, argv, "--output", "");
+    if(argc < 5 || grid.size() == 0)
+    {
+        LOG(ERROR) <<
+        "This program is used to tune the parameters of the candidate filter on saved distance sequences\n"
+        "用法：sweepFilter [--a list] [--window_size list] [--min_space list] [--tolerance N] [--threads N] [--output file] distances_dir blob_name video_file_list ground_truth_dir\n"
+        "distances_dir:calculateDistance --save_distances的output_dir，距离序列为distances_dir/blob_name/视频名_distances\n"
+        "blob_name:要评估的特征的名字\n"
+        "video_file_list:包含所有视频文件路径的文本文件\n"
+        "ground_truth_dir:标注目录，ground_truth_dir/视频名_transitions每行为一个镜头边界的起止帧\"begin end\"，突变可以只写一个帧序号\n"
+        "list:用逗号隔开的取值，或者start:end:step，默认--a 0.1:2:0.1 --window_size 4:32:2 --min_space 0:20:5\n"
+        "--tolerance N:candidate距离标注区间不超过N帧时算作命中，默认为5\n"
+        "--threads N:并行处理视频的线程数，默认为CPU核数\n"
+        "--output file:结果写入file，默认输出到标准输出，每行为a,window_size,min_space,precision,recall,f1,tp,fp,fn\n";
+        return 1;
+    }
+    for(int window_size : grid.window_sizes)
+        CHECK_GE(window_size, 2) << "the window size must >= 2";
+    CHECK_GE(num_threads, 1) << "the number of threads must >= 1";
+    string distances_dir(argv[1]);
+    if(distances_dir.back() != '/')
+        distances_dir.push_back('/');
+    string blob_name(argv[2]);
+    string ground_truth_dir(argv[4]);
+    if(ground_truth_dir.back() != '/')
+        ground_truth_dir.push_back('/');
+    std::ifstream videos_stream(argv[3]);
+    if(!videos_stream.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << argv[3];
+        return 1;
+    }
+    vector<string> videos;
+    string video_file;
+    while(videos_stream >> video_file)
+        videos.push_back(videoName(video_file));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    //每个线程累加自己处理的视频的结果，最后再求和
+    std::atomic<size_t> next_video(0);
+    std::atomic<int> num_failed(0);
+    vector<vector<Counts>> thread_counts(num_threads, vector<Counts>(grid.size(), Counts{0, 0, 0}));
+    vector<std::thread> threads;
+    for(int thread_id = 0; thread_id < num_threads; ++thread_id)
+    {
+        threads.push_back(std::thread([&, thread_id]{
+            vector<RateDistances> all_rates;
+            vector<Transition> transitions;
+            for(size_t i = next_video++; i < videos.size(); i = next_video++)
+            {
+                if(loadDistances(distances_dir + blob_name + "/" + videos[i] + "_distances", all_rates)
+                    || loadTransitions(ground_truth_dir + videos[i] + "_transitions", transitions))
+                {
+                    ++num_failed;
+                    continue;
+                }
+                evaluateVideo(all_rates, transitions, grid, thread_counts[thread_id]);
+            }
+        }));
+    }
+    for(auto &thread : threads)
+        thread.join();
+    vector<Counts> counts(grid.size(), Counts{0, 0, 0});
+    for(const auto &partial : thread_counts)
+    {
+        for(size_t k = 0; k < counts.size(); ++k)
+        {
+            counts[k].tp += partial[k].tp;
+            counts[k].fp += partial[k].fp;
+            counts[k].fn += partial[k].fn;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream output_stream;
+    if(!output_file.empty())
+    {
+        output_stream.open(output_file);
+        if(!output_stream.is_open())
+        {
+            LOG(ERROR) << "cannot create the file " << output_file;
+            return 1;
+        }
+    }
+    std::ostream &output = output_file.empty() ? std::cout : output_stream;
+    output << "a,window_size,min_space,precision,recall,f1,tp,fp,fn\n";
+    size_t best = 0;
+    double best_f1 = -1;
+    for(size_t ai = 0; ai < grid.a.size(); ++ai)
+    {
+        for(size_t wi = 0; wi < grid.window_sizes.size(); ++wi)
+        {
+            for(size_t mi = 0; mi < grid.min_spaces.size(); ++mi)
+            {
+                const size_t k = grid.index(ai, wi, mi);
+                const Counts &c = counts[k];
+                double precision = c.tp + c.fp > 0 ? static_cast<double>(c.tp) / (c.tp + c.fp) : 0;
+                double recall = c.tp + c.fn > 0 ? static_cast<double>(c.tp) / (c.tp + c.fn) : 0;
+                double f1 = precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0;
+                if(f1 > best_f1)
+                {
+                    best_f1 = f1;
+                    best = k;
+                }
+                output << grid.a[ai] << "," << grid.window_sizes[wi] << "," << grid.min_spaces[mi] << ","
+                    << precision << "," << recall << "," << f1 << "," << c.tp << "," << c.fp << "," << c.fn << "\n";
+            }
+        }
+    }
+    const size_t ai = best / (grid.window_sizes.size() * grid.min_spaces.size());
+    const size_t wi = best / grid.min_spaces.size() % grid.window_sizes.size();
+    const size_t mi = best % grid.min_spaces.size();
+    LOG(ERROR) << "evaluated " << grid.size() << " parameter sets on " << videos.size() - num_failed.load() << " videos in "
+        << seconds << " seconds";
+    LOG(ERROR) << "best f1 " << best_f1 << " with a=" << grid.a[ai] << " window_size=" << grid.window_sizes[wi]
+        << " min_space=" << grid.min_spaces[mi];
+    return num_failed > 0 ? 1 : 0;
+}
+
+//解析"v1,v2,..."或者"start:end:step"形式的取值列表
+vector<double> parseValues(const string &spec)
+{
+    vector<double> values;
+    if(spec.find(':') != string::npos)
+    {
+        double begin = 0, end = 0, step = 0;
+        char colon1 = 0, colon2 = 0;
+        std::istringstream stream(spec);
+        stream >> begin >> colon1 >> end >> colon2 >> step;
+        CHECK(stream && colon1 == ':' && colon2 == ':' && step > 0) << "invalid range " << spec;
+        //用整数计数，避免累加step的舍入误差漏掉end
+        for(int k = 0; begin + k * step <= end + step * 1e-6; ++k)
+            values.push_back(begin + k * step);
+        return values;
+    }
+    std::istringstream stream(spec);
+    string item;
+    while(std::getline(stream, item, ','))
+        values.push_back(std::stod(item));
+    return values;
+}
+
+//读取saveDistances保存的距离序列，成功返回0，失败返回1
+//距离文件可能很大，整个读入内存后用strtol/strtof解析，比逐项用>>读取快数倍
+int loadDistances(const string &file_name, vector<RateDistances> &all_rates)
+{
+    std::ifstream input(file_name, std::ios::binary);
+    if(!input.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << file_name;
+        return 1;
+    }
+    string content((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    all_rates.clear();
+    const char *p = content.c_str();
+    char *end = nullptr;
+    while(true)
+    {
+        while(std::isspace(static_cast<unsigned char>(*p)))
+            ++p;
+        if(*p == '\0')
+            return 0;
+        if(std::strncmp(p, "rate", 4) != 0)
+            break;
+        RateDistances rate;
+        rate.rate = std::strtol(p + 4, &end, 10);
+        long count = std::strtol(end, &end, 10);
+        if(count < 0)
+            break;
+        rate.distances.resize(count);
+        for(auto &item : rate.distances)
+        {
+            item.first = std::strtol(end, &end, 10);
+            p = end;
+            item.second = std::strtof(p, &end);
+            if(end == p)
+                break;
+        }
+        if(end == p)
+            break;
+        p = end;
+        all_rates.push_back(std::move(rate));
+    }
+    LOG(ERROR) << "invalid distances file " << file_name;
+    return 1;
+}
+
+//读取标注的镜头边界，每行为"begin end"或者一个帧序号，#开始的行是注释
+//成功返回0，失败返回1
+int loadTransitions(const string &file_name, vector<Transition> &transitions)
+{
+    std::ifstream input(file_name);
+    if(!input.is_open())
+    {
+        LOG(ERROR) << "cannot open the file " << file_name;
+        return 1;
+    }
+    transitions.clear();
+    string line;
+    while(std::getline(input, line))
+    {
+        std::istringstream stream(line);
+        Transition transition;
+        if(line.empty() || line[0] == '#' || !(stream >> transition.begin))
+            continue;
+        if(!(stream >> transition.end))
+            transition.end = transition.begin;
+        if(transition.end < transition.begin)
+            std::swap(transition.begin, transition.end);
+        transitions.push_back(transition);
+    }
+    std::sort(transitions.begin(), transitions.end(),
+        [](const Transition &x, const Transition &y){return x.begin < y.begin;});
+    return 0;
+}
+
+//FilterEngine中算法1的阈值T = local_mean + a * local_sigma * (1 + ln(global_mean / local_mean))，
+//d(c) > T等价于a * local_sigma * k < d(c) - local_mean，因此每一帧被选中时a的取值是一个区间，
+//只保留和[a_min, a_max]相交的帧
+void candidateRanges(const vector<pair<int,float>> &distances, const FilterEngine &engine, int window_size,
+    double a_min, double a_max, vector<CandidateRange> &ranges)
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    const double global_mean = engine.globalMean();
+    vector<double> means, sigmas;
+    engine.windowStatistics(window_size, means, sigmas);
+    ranges.clear();
+    for(size_t k = 0; k < means.size(); ++k)
+    {
+        const int c = k + window_size - 1;
+        const double d = distances[c].second;
+        double low = inf, high = -inf;
+        if((d > 3 * distances[c - 1].second || d > 3 * distances[c + 1].second) && d > 0.8 * global_mean)
+        {
+            low = -inf;
+            high = inf;
+        }else
+        {
+            const double scale = sigmas[k] * (1 + std::log(global_mean / means[k]));
+            //阈值没有定义(如局部均值为0)时只看相邻距离的条件，和FilterEngine中比较NaN的结果一致
+            if(!std::isfinite(scale))
+                continue;
+            if(scale > 0)
+            {
+                low = -inf;
+                high = (d - means[k]) / scale;
+            }else if(scale < 0)
+            {
+                low = (d - means[k]) / scale;
+                high = inf;
+            }else if(d > means[k])
+            {
+                low = -inf;
+                high = inf;
+            }
+        }
+        if(low < a_max && high > a_min)
+            ranges.push_back(CandidateRange{distances[c].first, low, high});
+    }
+}
+
+//按帧序号的顺序把candidate和标注一一匹配，candidate落在[begin - tolerance, end + tolerance]中时命中
+void matchTransitions(const vector<int> &candidates, const vector<Transition> &transitions, int tolerance, Counts &counts)
+{
+    size_t next = 0;
+    long long tp = 0;
+    for(int candidate : candidates)
+    {
+        //跳过已经不可能被命中的标注
+        while(next < transitions.size() && transitions[next].end + tolerance < candidate)
+            ++next;
+        if(next < transitions.size() && transitions[next].begin - tolerance <= candidate)
+        {
+            ++tp;
+            ++next;
+        }
+    }
+    counts.tp += tp;
+    counts.fp += candidates.size() - tp;
+    counts.fn += transitions.size() - tp;
+}
+
+//在单个视频上评估所有参数组合，结果累加到counts中
+void evaluateVideo(const vector<RateDistances> &all_rates, const vector<Transition> &transitions, const Grid &grid,
+    vector<Counts> &counts)
+{
+    const size_t num_rates = all_rates.size();
+    const double a_min = *std::min_element(grid.a.begin(), grid.a.end());
+    const double a_max = *std::max_element(grid.a.begin(), grid.a.end());
+    FilterEngine engine;
+    //ranges[w][r]: 第w个窗口大小在第r个采样率上可能被选中的帧
+    vector<vector<vector<CandidateRange>>> ranges(grid.window_sizes.size(), vector<vector<CandidateRange>>(num_rates));
+    for(size_t r = 0; r < num_rates; ++r)
+    {
+        engine.setDistances(all_rates[r].distances);
+        for(size_t wi = 0; wi < grid.window_sizes.size(); ++wi)
+            candidateRanges(all_rates[r].distances, engine, grid.window_sizes[wi], a_min, a_max, ranges[wi][r]);
+    }
+    vector<vector<int>> candidates(num_rates);
+    vector<int> merged;
+    for(size_t wi = 0; wi < grid.window_sizes.size(); ++wi)
+    {
+        for(size_t ai = 0; ai < grid.a.size(); ++ai)
+        {
+            const double a = grid.a[ai];
+            for(size_t r = 0; r < num_rates; ++r)
+            {
+                candidates[r].clear();
+                for(const CandidateRange &range : ranges[wi][r])
+                {
+                    if(range.low < a && a < range.high)
+                        candidates[r].push_back(range.frame_no);
+                }
+            }
+            for(size_t mi = 0; mi < grid.min_spaces.size(); ++mi)
+            {
+                mergeCandidates(candidates, grid.min_spaces[mi], merged);
+                matchTransitions(merged, transitions, grid.tolerance, counts[grid.index(ai, wi, mi)]);
+            }
+        }
+    }
+}
+
+//去掉路径中的目录，和calculateDistance输出文件中的视频名一致
+string videoName(const string &video_file)
+{
+    auto pos = video_file.rfind('/');
+    return pos == string::npos ? video_file : video_file.substr(pos + 1);
+}
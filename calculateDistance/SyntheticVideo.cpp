@@ -0,0 +1,40 @@
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "SyntheticVideo.hpp"
+
+//镜头内平移的最大像素数，超过后往回移动
+const int kPanRange = 64;
+
+int writeSyntheticVideo(const string &video_file, int num_frames, int height, int width, const vector<int> &cuts,
+    unsigned seed)
+{
+    cv::VideoWriter writer(video_file, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 25, cv::Size(width, height));
+    if(!writer.isOpened())
+    {
+        LOG(ERROR) << "cannot create the video " << video_file;
+        return 1;
+    }
+    cv::RNG rng(seed);
+    cv::Mat coarse(height / 16, width / 16, CV_8UC3), scene, frame;
+    size_t next_cut = 0;
+    int shot_begin = 0;
+    for(int i = 0; i < num_frames; ++i)
+    {
+        if(i == 0 || (next_cut < cuts.size() && cuts[next_cut] == i))
+        {
+            if(i != 0)
+                ++next_cut;
+            shot_begin = i;
+            rng.fill(coarse, cv::RNG::UNIFORM, 0, 256);
+            cv::resize(coarse, scene, cv::Size(width + kPanRange, height + kPanRange / 2), 0, 0, cv::INTER_CUBIC);
+        }
+        int offset = (i - shot_begin) % (2 * kPanRange);
+        int shift = offset < kPanRange ? offset : 2 * kPanRange - offset;
+        scene(cv::Rect(shift, shift / 2, width, height)).copyTo(frame);
+        writer.write(frame);
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+/*
+**生成用于测试的合成视频，镜头边界的位置已知*
+**每个镜头是一个平滑的随机场景，镜头内逐帧平移模拟摄像机运动，镜头之间是硬切*
+*/
+#ifndef SYNTHETICVIDEO_HPP_
+#define SYNTHETICVIDEO_HPP_
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+//把num_frames帧height x width的MJPG视频写入video_file
+//cuts: 递增的硬切位置，第cuts[k]帧是一个新镜头的第一帧
+//seed: 场景内容的随机种子，相同的参数总是生成相同的视频
+//成功返回0，失败返回1
+int writeSyntheticVideo(const string &video_file, int num_frames, int height, int width, const vector<int> &cuts,
+    unsigned seed = 2018);
+#endif
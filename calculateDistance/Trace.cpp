@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+#include <glog/logging.h>
+
+#include "Trace.hpp"
+#include "Json.hpp"
+
+using std::vector;
+
+namespace {
+
+struct TraceEvent{
+    const char *name;
+    int video;
+    Tracer::Clock::time_point begin;
+    Tracer::Clock::time_point end;
+};
+
+//一个线程的事件，只由该线程写入，进程退出时读取
+struct ThreadBuffer{
+    int tid;
+    string name;
+    vector<TraceEvent> events;
+};
+
+//所有线程的缓冲区在进程退出前都不释放，线程结束后其事件仍然保留
+struct TraceRegistry{
+    std::mutex mutex;
+    string trace_file;
+    Tracer::Clock::time_point origin;
+    vector<std::unique_ptr<ThreadBuffer> > buffers;
+    vector<string> videos;
+};
+
+TraceRegistry& registry()
+{
+    static TraceRegistry *instance = new TraceRegistry();   //不析构，atexit中仍然可以使用
+    return *instance;
+}
+
+thread_local ThreadBuffer *t_buffer = nullptr;
+thread_local int t_video = -1;
+
+ThreadBuffer& threadBuffer()
+{
+    if(t_buffer == nullptr)
+    {
+        TraceRegistry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.buffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+        t_buffer = r.buffers.back().get();
+        t_buffer->tid = static_cast<int>(r.buffers.size());
+        t_buffer->name = "thread " + std::to_string(t_buffer->tid);
+        t_buffer->events.reserve(1024);
+    }
+    return *t_buffer;
+}
+
+//把所有线程的事件写成Chrome trace-event格式，时间单位为微秒
+void writeTrace()
+{
+    TraceRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::ofstream output(r.trace_file);
+    if(!output.is_open())
+    {
+        LOG(ERROR) << "cannot create the file " << r.trace_file;
+        return;
+    }
+    const int pid = getpid();
+    output << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    output << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"args\": {\"name\": \"calculateDistance\"}}";
+    output.setf(std::ios::fixed);
+    output.precision(3);
+    size_t num_events = 0;
+    for(const auto &buffer : r.buffers)
+    {
+        output << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << buffer->tid
+            << ", \"args\": {\"name\": " << jsonString(buffer->name) << "}}";
+        for(const TraceEvent &event : buffer->events)
+        {
+            double ts = std::chrono::duration<double, std::micro>(event.begin - r.origin).count();
+            double dur = std::chrono::duration<double, std::micro>(event.end - event.begin).count();
+            output << ",\n{\"name\": " << jsonString(event.name) << ", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << buffer->tid
+                << ", \"ts\": " << ts << ", \"dur\": " << dur;
+            if(event.video >= 0)
+                output << ", \"args\": {\"video\": " << jsonString(r.videos[event.video]) << "}";
+            output << "}";
+        }
+        num_events += buffer->events.size();
+    }
+    output << "\n]}\n";
+    LOG(ERROR) << "wrote " << num_events << " trace events to " << r.trace_file;
+}
+
+}
+
+std::atomic<bool> Tracer::s_enabled(false);
+
+void Tracer::start(const string &trace_file)
+{
+    TraceRegistry &r = registry();
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        CHECK(r.trace_file.empty()) << "the trace has already been started";
+        r.trace_file = trace_file;
+        r.origin = Clock::now();
+    }
+    std::atexit(writeTrace);
+    s_enabled = true;
+}
+
+void Tracer::setThreadName(const string &name)
+{
+    if(enabled())
+        threadBuffer().name = name;
+}
+
+int Tracer::registerVideo(const string &video_file)
+{
+    TraceRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.videos.push_back(video_file);
+    return static_cast<int>(r.videos.size()) - 1;
+}
+
+void Tracer::setCurrentVideo(int video)
+{
+    t_video = video;
+}
+
+int Tracer::currentVideo()
+{
+    return t_video;
+}
+
+void Tracer::record(const char *name, Clock::time_point begin, Clock::time_point end)
+{
+    threadBuffer().events.push_back(TraceEvent{name, t_video, begin, end});
+}
@@ -0,0 +1,83 @@
+/*
+**Chrome trace-event格式的时间线，生成的文件可以用Perfetto(ui.perfetto.dev)或chrome://tracing打开*
+**每个线程把事件写入自己的缓冲区，记录时不加锁；只有线程第一次记录事件和登记视频时需要加锁*
+**所有缓冲区在进程退出时(atexit)一起写入文件，此时流水线的线程都已结束*
+**没有调用Tracer::start()时，TraceScope只读取一个原子变量，不记录任何事件*
+*/
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+using std::string;
+
+class Tracer{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    //开始记录事件，进程退出时写入trace_file
+    static void start(const string &trace_file);
+    static bool enabled() {return s_enabled.load(std::memory_order_relaxed);}
+    //当前线程在时间线上显示的名字
+    static void setThreadName(const string &name);
+    //登记一个视频，返回之后用于setCurrentVideo的编号
+    static int registerVideo(const string &video_file);
+    //当前线程之后记录的事件都属于编号为video的视频，-1表示不属于任何视频
+    //流水线中新建的线程需要从创建它的线程继承这个编号
+    static void setCurrentVideo(int video);
+    static int currentVideo();
+    //记录一个[begin, end)的事件，name必须是字符串常量
+    static void record(const char *name, Clock::time_point begin, Clock::time_point end);
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+//在作用域结束时记录一个从构造到析构的事件
+class TraceScope{
+public:
+    explicit TraceScope(const char *name):m_name(Tracer::enabled() ? name : nullptr)
+    {
+        if(m_name != nullptr)
+            m_begin = Tracer::Clock::now();
+    }
+    ~TraceScope()
+    {
+        if(m_name != nullptr)
+            Tracer::record(m_name, m_begin, Tracer::Clock::now());
+    }
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+
+    const char *m_name;
+    Tracer::Clock::time_point m_begin;
+};
+
+//处理一个视频的整个过程：登记视频，把当前线程的事件归到该视频，并记录一个名为video的事件
+class TraceVideo{
+public:
+    explicit TraceVideo(const string &video_file):m_enabled(Tracer::enabled()),m_previous(Tracer::currentVideo())
+    {
+        if(m_enabled)
+        {
+            Tracer::setCurrentVideo(Tracer::registerVideo(video_file));
+            m_begin = Tracer::Clock::now();
+        }
+    }
+    ~TraceVideo()
+    {
+        if(m_enabled)
+            Tracer::record("video", m_begin, Tracer::Clock::now());
+        Tracer::setCurrentVideo(m_previous);
+    }
+private:
+    TraceVideo(const TraceVideo&);
+    TraceVideo& operator=(const TraceVideo&);
+
+    bool m_enabled;
+    int m_previous;
+    Tracer::Clock::time_point m_begin;
+};
+#endif
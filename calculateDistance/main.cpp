@@ -3,6 +3,9 @@
 #include <fstream>
 #include <vector>
 #include <iomanip>
+#include <thread>
+#include <cmath>
+#include <algorithm>
 
 #include <glog/logging.h>
 #include <opencv2/core/core.hpp>
@@ -16,39 +19,93 @@
 #include "caffe/blob.hpp"
 #include "caffe/net.hpp"
 #include "CalculateDistance.hpp"
+#include "DistanceState.hpp"
+#include "FeatureExtractor.hpp"
+#include "StreamingDetector.hpp"
+#include "FeatureStore.hpp"
+#include "FilterEngine.hpp"
+#include "BlockingQueue.hpp"
+#include "StageProfile.hpp"
+#include "Trace.hpp"
+#include "Options.hpp"
 #include "caffe/util/io.hpp"
 
 using std::string;
 using std::vector;
 using std::pair;
 using caffe::Caffe;
-using caffe::InputParameter;
 using caffe::Net;
 using boost::filesystem::path;
 
-vector<int> filtering(const vector<std::pair<int,float>> &distances, float a, int window_size);
-vector<int> merge_candidates(vector<vector<int>> &candidates_at_all_sampleRates);
-int processVideo(const string &video_file, const string &pretrained_binary_proto, const string &feature_extraction_proto,
-    const string &extract_feature_blob_names, const string &distance_type,int new_height, int new_width, const vector<int> &all_rates, const string &mode,int device_id,const string &output_dir);
+int processVideo(const string &video_file, FeatureExtractor &extractor, DistanceState &state, const string &output_dir,
+    const FeatureStore *store, const CandidateSelector &selector, bool save_distances, StageProfile *profile);
+int processVideoStreaming(const string &video_file, FeatureExtractor &extractor, DistanceState &state, const string &output_dir,
+    const FeatureStore *store, const CandidateSelector &selector, StageProfile *profile);
+int processVideoInSegments(const string &video_file, const vector<FeatureExtractor*> &extractors, vector<DistanceState> &segment_states,
+    DistanceState &state, const string &output_dir, const FeatureStore *store, const CandidateSelector &selector, bool save_distances,
+    StageProfile *profile);
+int extractFeatures(const string &video_file, FeatureExtractor &extractor, DistanceState &state, const FeatureStore *store,
+    StageProfile *profile);
+int outputCandidates(const string &video_file, const vector<string> &blob_names, const DistanceState &state, const string &output_dir,
+    const CandidateSelector &selector, bool save_distances, StageProfile *profile);
+int writeReport(const string &video_file, const vector<string> &blob_names, const string &output_dir, const StageProfile *profile);
+int saveDistances(const string &output_file, const DistanceState &state, size_t feature_index);
+string candidatesFile(const string &video_file, const string &blob_name, const string &output_dir, const string &suffix = "_candidates");
+bool seekToFrame(cv::VideoCapture &cap, int frame_no);
+bool hashVideo(const FeatureStore &store, const string &video_file, uint64_t &video_hash);
 //启动的主函数
 int main(int argc, char **argv)
 {
     ::google::InitGoogleLogging(argv[0]);
+    //可选参数，可以出现在任意位置
+    int num_workers = std::stoi(takeOption(argc, argv, "--workers", "1"));
+    CHECK_GE(num_workers, 1) << "the number of workers must >= 1";
+    int num_segments = std::stoi(takeOption(argc, argv, "--segments", "1"));
+    CHECK_GE(num_segments, 1) << "the number of segments must >= 1";
+    CHECK(num_workers == 1 || num_segments == 1) << "--workers and --segments cannot be used together";
+    bool streaming = takeFlag(argc, argv, "--streaming");
+    CHECK(!streaming || num_segments == 1) << "--streaming and --segments cannot be used together";
+    string feature_cache = takeOption(argc, argv, "--feature_cache", "");
+    bool save_distances = takeFlag(argc, argv, "--save_distances");
+    CHECK(!streaming || !save_distances) << "--streaming does not keep the distance sequences to save";
+    bool report = takeFlag(argc, argv, "--report");
+    string trace_file = takeOption(argc, argv, "--trace", "");
+    string mean_values = takeOption(argc, argv, "--mean", "");
+    CandidateSelector selector;
+    string formula_name = takeOption(argc, argv, "--filter", "adaptive");
+    CHECK(FilterParam::formulaFromName(formula_name, selector.param.formula)) << "unknown filter " << formula_name;
+    selector.param.a = std::stof(takeOption(argc, argv, "--a", "0.7"));
+    selector.param.static_th = std::stof(takeOption(argc, argv, "--static_th", "0.05"));
+    selector.param.window_size = std::stoi(takeOption(argc, argv, "--window_size", "16"));
+    CHECK_GE(selector.param.window_size, 2) << "the window size must >= 2";
+    selector.min_space = std::stoi(takeOption(argc, argv, "--min_space", "5"));
+    CHECK(!streaming || selector.param.formula == FilterParam::kAdaptive) << "--streaming only supports the adaptive filter";
+    float scale = std::stof(takeOption(argc, argv, "--scale", "1"));
     const int num_required_args = 10;
     if(argc < num_required_args){
         LOG(ERROR) <<
         "This program is used to select candidate transiton center for a list of videos\n"
-        "用法：calculateDistance pretained_net_param net_protofile blob_names video_file_list new_height new_width distance_type sampleRates output_dir [CPU/GPU] [device_id]"
+        "用法：calculateDistance [--workers N] [--segments N] [--streaming] [--feature_cache dir] [--save_distances] [--report] [--trace out.json] [--filter adaptive|static] [--a a] [--static_th t] [--window_size w] [--min_space m] [--mean b,g,r] [--scale s] pretained_net_param net_protofile blob_names video_file_list new_height new_width distance_type sampleRates output_dir [CPU/GPU] [device_id]"
         "pretrained_net_param:训练好的网络模型的参数\n"
         "net_protofile:网络的proto txt文件\n"
-        "blob_names :要提取的特征对应的blob的名字,用逗号隔开\n"
+        "blob_names :要提取的特征对应的blob的名字,用逗号隔开，网络只计算这些blob依赖的层\n"
         "video_file_list:包含所有视频文件路径的文本文件\n"
         "new_height:缩放后的图像高度\n"
         "new_width:缩放后的图像宽度\n"
-        "distance_type: 距离度量的类型，目前有Cosine\n"
+        "distance_type: 距离度量的类型，目前有Cosine, L2, L1, ChiSquare, HistIntersection, Hamming\n"
         "sampleRates:采样率序列，用逗号隔开\n"
         "output_dir:输出目录\n"
-        "可选的[CPU/GPU] [device_id]";
+        "可选的[CPU/GPU] [device_id]\n"
+        "--workers N:同时处理N个视频，每个线程有自己的激活值，共享同一份训练好的参数，只支持CPU模式\n"
+        "--segments N:把单个视频分成N段并行处理，再拼接各段的距离序列，结果和串行处理相同，视频不能精确定位或帧数不准确时退化为串行处理，只支持CPU模式\n"
+        "--streaming:流式处理，每个candidate在其后window_size个采样帧到达后立即输出，适用于直播流，全局均值使用到目前为止的均值\n"
+        "--feature_cache dir:把每个视频的特征缓存在dir中，按视频内容、模型和特征名索引，再次处理同一视频时不再解码和提取特征\n"
+        "--save_distances:同时把每个特征在各个采样率上的距离序列保存到output_dir/特征名/视频名_distances，供sweepFilter调整过滤参数\n"
+        "--report:为每个视频输出output_dir/第一个特征名/视频名_report.json，包含处理的帧数、帧率、解码、预处理、Forward、距离计算、过滤、合并和输出各阶段的时间以及batch延迟的分位数\n"
+        "--trace out.json:把每个线程上每次解码、预处理、Forward、距离计算、写入和队列等待的起止时间以Chrome trace-event格式写入out.json，可以用Perfetto打开\n"
+        "--filter:过滤算法，adaptive为T = local_mean + a * local_sigma * (1 + ln(global_mean / local_mean))，static为T = static_th + a * local_mean，默认adaptive\n"
+        "--a --static_th --window_size --min_space:过滤算法的参数和不同采样率的candidate之间的最小间隔，默认为0.7 0.05 16 5，可以用sweepFilter搜索\n"
+        "--mean b,g,r --scale s:预处理时对每个像素计算(x - mean) * scale，默认不做变换\n";
 
         return 1;
     }
@@ -71,6 +128,11 @@ int main(int argc, char **argv)
     int new_height = atoi(argv[++arg_pos]);
     int new_width = atoi(argv[++arg_pos]); 
     string distance_type(argv[++arg_pos]);
+    if(!CreateCalculator<float>().create(distance_type))
+    {
+        LOG(ERROR) << "unknown distance type " << distance_type;
+        return 1;
+    }
 
     //获得采样率序列
     string sampleRates(argv[++arg_pos]);
@@ -86,44 +148,198 @@ int main(int argc, char **argv)
     std::sort(all_rates.begin(),all_rates.end());   //确保采样率是递增的
 
     string output_dir(argv[++arg_pos]);
-    //读取视频文件并依次处理单个视频
+
+    if(!trace_file.empty())
+    {
+        Tracer::start(trace_file);
+        Tracer::setThreadName("main");
+    }
+    //初始化网络，网络只加载一次，被所有视频复用
+    if(mode == "GPU")
+    {
+        LOG(ERROR)<< "Using GPU";
+        LOG(ERROR) << "Using Device_id=" << device_id;
+        Caffe::SetDevice(device_id);
+        Caffe::set_mode(Caffe::GPU);
+    }else
+    {
+        LOG(ERROR) << "Using CPU";
+        Caffe::set_mode(Caffe::CPU);
+    }
+    FeatureExtractor extractor(pretrained_binary_proto, feature_extraction_proto, extract_feature_blob_names, new_height, new_width);
+    vector<float> mean;
+    if(!mean_values.empty())
+    {
+        boost::split(temp,mean_values,boost::is_any_of(","));
+        for(size_t i = 0; i < temp.size();++i)
+            mean.push_back(std::stof(temp[i]));
+    }
+    extractor.setNormalization(mean, scale);
+    boost::shared_ptr<FeatureStore> store;
+    if(!feature_cache.empty())
+        store.reset(new FeatureStore(feature_cache, pretrained_binary_proto, feature_extraction_proto, extractor.preprocessParam()));
     std::ifstream videos_stream(contain_videos_file);
-    if(videos_stream.is_open())
+    if(!videos_stream.is_open())
     {
+        LOG(ERROR) << "cannot open the file " << contain_videos_file;
+        return 0;
+    }
+    //读取视频文件，每个视频分成多段，由多个线程并行处理
+    if(num_segments > 1)
+    {
+        CHECK_EQ(mode, "CPU") << "--segments is only supported in CPU mode";
+        //第0段直接使用extractor，其余各段的网络共享extractor中训练好的参数
+        vector<boost::shared_ptr<FeatureExtractor> > own_extractors;
+        vector<FeatureExtractor*> extractors(1, &extractor);
+        for(int i = 1; i < num_segments; ++i)
+        {
+            own_extractors.push_back(boost::shared_ptr<FeatureExtractor>(new FeatureExtractor(&extractor)));
+            extractors.push_back(own_extractors.back().get());
+        }
+        vector<DistanceState> segment_states(num_segments, DistanceState(distance_type, all_rates, extractor.featureDims()));
+        DistanceState state(distance_type, all_rates, extractor.featureDims());
+        StageProfile profile;
+        string video_name;
+        while(videos_stream >> video_name)
+        {
+            LOG(ERROR) << "start  processing " << video_name << " in " << num_segments << " segments";
+            state.reset();
+            profile.start();
+            TraceVideo trace(video_name);
+            if(processVideoInSegments(video_name, extractors, segment_states, state, output_dir, store.get(), selector, save_distances,
+                report ? &profile : nullptr)
+                || writeReport(video_name, extractor.blobNames(), output_dir, report ? &profile : nullptr))
+                LOG(ERROR) << "cannot calculate distances sequence for video " << video_name;
+        }
+        return 0;
+    }
+    //读取视频文件并依次处理单个视频
+    if(num_workers == 1)
+    {
+        DistanceState state(distance_type, all_rates, extractor.featureDims());
+        StageProfile profile;
+        StageProfile *profile_ptr = report ? &profile : nullptr;
         string video_name;
         while(videos_stream >> video_name)
         {
             LOG(ERROR) << "start  processing " << video_name;
-            if(processVideo(video_name,pretrained_binary_proto, feature_extraction_proto,extract_feature_blob_names,distance_type,new_height,
-                new_width, all_rates, mode, device_id,output_dir))
+            state.reset();
+            profile.start();
+            TraceVideo trace(video_name);
+            int failed = streaming ? processVideoStreaming(video_name, extractor, state, output_dir, store.get(), selector, profile_ptr)
+                : processVideo(video_name, extractor, state, output_dir, store.get(), selector, save_distances, profile_ptr);
+            if(!failed)
+                failed = writeReport(video_name, extractor.blobNames(), output_dir, profile_ptr);
+            if(failed)
                 LOG(ERROR) << "cannot calculate distances sequence for video " << video_name;
+        }
+        return 0;
+    }
 
+    //多个线程从同一个队列中取视频进行处理
+    //第0个线程直接使用extractor，其余线程的网络共享extractor中训练好的参数
+    CHECK_EQ(mode, "CPU") << "--workers is only supported in CPU mode";
+    BlockingQueue<string> video_queue(num_workers);
+    vector<std::thread> workers;
+    for(int worker_id = 0; worker_id < num_workers; ++worker_id)
+    {
+        workers.push_back(std::thread([&, worker_id]{
+            Caffe::set_mode(Caffe::CPU);    //Caffe的运行模式是线程局部的
+            Tracer::setThreadName("worker " + std::to_string(worker_id));
+            boost::shared_ptr<FeatureExtractor> own_extractor;
+            FeatureExtractor *worker_extractor = &extractor;
+            if(worker_id > 0)
+            {
+                own_extractor.reset(new FeatureExtractor(&extractor));
+                worker_extractor = own_extractor.get();
+            }
+            DistanceState state(distance_type, all_rates, worker_extractor->featureDims());
+            StageProfile profile;
+            StageProfile *profile_ptr = report ? &profile : nullptr;
+            string video_name;
+            while(video_queue.pop(video_name))
+            {
+                LOG(ERROR) << "worker " << worker_id << " start  processing " << video_name;
+                state.reset();
+                profile.start();
+                TraceVideo trace(video_name);
+                int failed = streaming ? processVideoStreaming(video_name, *worker_extractor, state, output_dir, store.get(), selector, profile_ptr)
+                    : processVideo(video_name, *worker_extractor, state, output_dir, store.get(), selector, save_distances, profile_ptr);
+                if(!failed)
+                    failed = writeReport(video_name, worker_extractor->blobNames(), output_dir, profile_ptr);
+                if(failed)
+                    LOG(ERROR) << "cannot calculate distances sequence for video " << video_name;
+            }
+        }));
+    }
+    string video_name;
+    while(videos_stream >> video_name)
+        video_queue.push(video_name);
+    video_queue.close();
+    for(auto &worker : workers)
+        worker.join();
+    return 0;
+}
 
+//candidate输出文件的路径：output_dir/特征名/视频名_candidates，必要时创建特征名对应的目录
+//suffix为其他后缀时得到同一目录中的其他输出文件，创建目录失败时返回空字符串
+string candidatesFile(const string &video_file, const string &blob_name, const string &output_dir, const string &suffix)
+{
+    auto pos = video_file.rfind('/');
+    string video_name;
+    if(pos == string::npos)
+        video_name = video_file;
+    else
+        video_name = video_file.substr(pos+1);
+    string output_file(output_dir);
+    if(output_dir.back() != '/')
+        output_file.push_back('/');
+    output_file += blob_name + "/";
+    path dir_name(output_file);
+    if(!exists(dir_name))
+        if(!create_directory(dir_name))
+        {
+            LOG(ERROR) << "cannot create the directory " << dir_name;
+            return string();
         }
-    }else
-        LOG(ERROR) << "cannot open the file " << contain_videos_file;
-    return 0;
+    return output_file + video_name + suffix;
 }
 
-//计算单个视频图像帧之间的距离序列
-//成功返回1，失败返回0
+//计算单个视频图像帧之间的距离序列，并筛选出candidate
+//成功返回0，失败返回1
 //输入参数：
 // video_file: 视频文件的路径
-// pretrained_binary_proto: 训练好的网络模型
-// feature_extraction_proto:网络的proto txt文件
-// extract_feature_blob_names:要提取的特征名字，用逗号隔开
-// distance_type:用于度量图像帧之间距离的类型，目前有Cosine
-// new_height,new_width: 视频帧用作网络输入时应转换成的新大小
-// all_rates: 对视频进行采样的采样率序列
-// mode: CPU/GPU
-// device_id: GPU的设备id
-// 输出：包含距离序列的一系列文件，文件命令方式：视频名_特征名_采样率
-int processVideo(const string &video_file, const string &pretrained_binary_proto, const string &feature_extraction_proto,
-    const string &extract_feature_blob_names, const string &distance_type,int new_height, int new_width, const vector<int> &all_rates, const string &mode,int device_id,const string &output_dir)
+// extractor: 已经加载好网络的特征提取器
+// state: 保存距离序列的状态，调用前需要reset
+// output_dir: 输出目录
+// store: 特征缓存，为nullptr时不使用缓存
+// selector: 过滤和合并candidate的参数
+// save_distances: 是否同时保存距离序列
+// profile: 记录各阶段的时间，为nullptr时不记录
+// 输出：每个特征一个目录，目录中的文件"视频名_candidates"包含所有的candidate
+int processVideo(const string &video_file, FeatureExtractor &extractor, DistanceState &state, const string &output_dir,
+    const FeatureStore *store, const CandidateSelector &selector, bool save_distances, StageProfile *profile)
 {
-    
+    if(extractFeatures(video_file, extractor, state, store, profile))
+        return 1;
+    return outputCandidates(video_file, extractor.blobNames(), state, output_dir, selector, save_distances, profile);
+}
+
+//得到单个视频的特征并交给state计算距离：缓存命中时直接读取缓存，否则解码视频并提取特征，同时写入缓存
+//成功返回0，失败返回1
+int extractFeatures(const string &video_file, FeatureExtractor &extractor, DistanceState &state, const FeatureStore *store,
+    StageProfile *profile)
+{
+    const vector<string> &blob_names = extractor.blobNames();
+    //视频不是普通文件(如直播流)时不使用缓存
+    uint64_t video_hash = 0;
+    bool use_store = store != nullptr && hashVideo(*store, video_file, video_hash);
+    if(use_store && store->load(video_hash, blob_names, extractor.featureDims(), state) == 0)
+    {
+        LOG(ERROR) << "load the features of " << video_file << " from the feature cache";
+        return 0;
+    }
     cv::VideoCapture cap;
-    cv::Mat img, img_origin;
 
     cap.open(video_file);
     if(!cap.isOpened())
@@ -131,214 +347,212 @@ int processVideo(const string &video_file, const string &pretrained_binary_proto
         LOG(ERROR) << "Cannot open " << video_file;
         return 1;
     }
-    int num_of_frames = cap.get(CV_CAP_PROP_FRAME_COUNT);
+    vector<shared_ptr<FeatureStoreWriter> > writers;
+    if(use_store)
+        writers = store->createWriters(video_hash, blob_names, extractor.featureDims(), state.frameStep());
+    vector<FeatureStoreWriter*> writer_ptrs;
+    for(auto &writer : writers)
+        writer_ptrs.push_back(writer.get());
+    extractor.setFeatureWriters(writer_ptrs);
+    extractor.setProfile(profile);
+    extractor.extract(cap, state);
+    extractor.setProfile(nullptr);
+    extractor.setFeatureWriters(vector<FeatureStoreWriter*>());
+    ScopedTimer timer(writers.empty() ? nullptr : profile, kOutputStage);
+    TraceScope trace(writers.empty() ? nullptr : "commit_cache");
+    for(auto &writer : writers)
+        writer->commit();
+    return 0;
+}
 
-    //获得batch_size
-    caffe::NetParameter net_param;
-    if(!ReadProtoFromTextFile(feature_extraction_proto, &net_param))
-    {
-        LOG(ERROR) << "Failed to parse input text file as NetParameter: "
-            << feature_extraction_proto;
-        return 1;
-    }
-    int batch_size = 1;
-    int width = 0, height = 0, channels = 0;
-    for(int i  = 0; i < net_param.layer_size();++i)
+//流式地处理单个视频(也可以是直播流的地址)，candidate一经确定就写入输出文件，不保存整个距离序列
+//成功返回0，失败返回1
+int processVideoStreaming(const string &video_file, FeatureExtractor &extractor, DistanceState &state, const string &output_dir,
+    const FeatureStore *store, const CandidateSelector &selector, StageProfile *profile)
+{
+    const vector<string> &blob_names = extractor.blobNames();
+    size_t num_features = blob_names.size();
+    vector<boost::shared_ptr<std::ofstream> > outputs;
+    vector<boost::shared_ptr<StreamingDetector> > detectors;
+    vector<StreamingDetector*> detector_ptrs;
+    for(size_t feature_index = 0; feature_index < num_features; ++feature_index)
     {
-        if(net_param.layer(i).name() == "data" && net_param.layer(i).type() == "Input")
+        string output_file = candidatesFile(video_file, blob_names[feature_index], output_dir);
+        if(output_file.empty())
+            return 1;
+        boost::shared_ptr<std::ofstream> output(new std::ofstream(output_file));
+        if(!output->is_open())
         {
-            CHECK(net_param.layer(i).has_input_param())
-                << "input layer data must have input_param";
-            const InputParameter &input_param = net_param.layer(i).input_param();
-            CHECK_GE(input_param.shape_size(),1) << "the input_param must specify the shape of input blob";
-            const caffe::BlobShape &input_shape = input_param.shape(0);
-            batch_size = input_shape.dim(0);
-            channels = input_shape.dim(1);
-            height = input_shape.dim(2);
-            width = input_shape.dim(3);
-            CHECK_EQ(height,new_height) << "new height must equal the height in input layer";
-            CHECK_EQ(width,new_width) << "new width must equal the width in input layer";
-
+            LOG(ERROR) << "cannot create the file " << output_file;
+            return 1;
         }
+        outputs.push_back(output);
+        //std::endl会刷新输出，candidate一经确定就对读取该文件的程序可见
+        detectors.push_back(boost::shared_ptr<StreamingDetector>(new StreamingDetector("", state.rates(), 0,
+            [output](int frame_no){ *output << frame_no << std::endl; },
+            selector.param.a, selector.param.window_size, selector.min_space)));
+        detector_ptrs.push_back(detectors.back().get());
     }
-    
-    int num_mini_batches = num_of_frames / batch_size + ((num_of_frames % batch_size) > 0 ? 1:0);
+    state.setDetectors(detector_ptrs);
+    int failed = extractFeatures(video_file, extractor, state, store, profile);
+    state.setDetectors(vector<StreamingDetector*>());
+    for(auto &detector : detectors)
+        detector->finish();
+    return failed;
+}
 
-    //初始化网络
-    if(mode == "GPU")
-    {
-        LOG(ERROR)<< "Using GPU";
-        LOG(ERROR) << "Using Device_id=" << device_id;
-        Caffe::SetDevice(device_id);
-        Caffe::set_mode(Caffe::GPU);
-    }else
+//把视频分成extractors.size()段，每段由一个线程用各自的extractor并行提取特征并计算距离
+//第i段负责第一帧序号在[begin_i, end_i)中的帧对，因此需要多解码max(rate)帧，跨越分段边界的帧对也能被计算，
+//将各段的距离序列依次拼接到state中，得到的结果和串行处理完全相同
+//有一段不能精确定位，或者解码的帧数少于计划的帧数(CV_CAP_PROP_FRAME_COUNT偏大)时，退化为串行处理整个视频，
+//此时分段处理已经花费的时间和解码的帧也计入profile
+//缓存命中时直接读取缓存，不再分段；分段提取的特征不写入缓存
+//成功返回0，失败返回1
+int processVideoInSegments(const string &video_file, const vector<FeatureExtractor*> &extractors, vector<DistanceState> &segment_states,
+    DistanceState &state, const string &output_dir, const FeatureStore *store, const CandidateSelector &selector, bool save_distances,
+    StageProfile *profile)
+{
+    uint64_t video_hash = 0;
+    if(store != nullptr && hashVideo(*store, video_file, video_hash)
+        && store->load(video_hash, extractors[0]->blobNames(), extractors[0]->featureDims(), state) == 0)
     {
-        LOG(ERROR) << "Using CPU";
-        Caffe::set_mode(Caffe::CPU);
+        LOG(ERROR) << "load the features of " << video_file << " from the feature cache";
+        return outputCandidates(video_file, extractors[0]->blobNames(), state, output_dir, selector, save_distances, profile);
     }
-    boost::shared_ptr<Net<float> > feature_extraction_net(
-      new Net<float>(feature_extraction_proto, caffe::TEST));
-    feature_extraction_net->CopyTrainedLayersFrom(pretrained_binary_proto);
-    std::vector<std::string> blob_names;
-    boost::split(blob_names, extract_feature_blob_names, boost::is_any_of(","));
-    size_t num_features = blob_names.size();
-    for (size_t i = 0; i < num_features; i++) {
-        CHECK(feature_extraction_net->has_blob(blob_names[i]))
-            << "Unknown feature blob name " << blob_names[i]
-            << " in the network " << feature_extraction_proto;
+    cv::VideoCapture cap;
+    cap.open(video_file);
+    if(!cap.isOpened())
+    {
+        LOG(ERROR) << "Cannot open " << video_file;
+        return 1;
     }
-
-    shared_ptr<CalculateDistance<float>> calculator = CreateCalculator<float>().create(distance_type);
-    //all_distances[i]表示第i个特征的距离序列集合
-    //all_distances[i][j]表示第i个特征在采样率j上的距离序列
-    vector<vector<vector<pair<int,float>>>> all_distances(num_features,vector<vector<pair<int,float>>>(all_rates.size()));
-    vector<vector<int>> to_compare(num_features);    //to_compare[i][j]第i特征在采样率j上要计算的帧的序号,初始均从0开始
-    for(size_t i = 0; i < num_features; ++i)
+    int num_of_frames = cap.get(CV_CAP_PROP_FRAME_COUNT);
+    int num_segments = extractors.size();
+    if(num_of_frames < num_segments)
     {
-        for(size_t j = 0; j < all_rates.size();++j)
-            to_compare[i].push_back(0);
+        //无法获得视频的帧数时退化为串行处理
+        cap.release();
+        return processVideo(video_file, *extractors[0], state, output_dir, store, selector, save_distances, profile);
     }
-    vector<vector<shared_ptr<float>>> last_compare(num_features, vector<shared_ptr<float>>(all_rates.size()));    //存放不同特征在不同采样率上的前次滑动窗中的最后一帧的特征
+    cap.release();
 
-    int window_begin = 0,window_end  = 0;
-    for(int i = 0; i < num_mini_batches; ++i)
+    const int max_rate = state.rates().back();
+    vector<int> results(num_segments, 0);
+    vector<std::thread> threads;
+    const int video = Tracer::currentVideo();
+    for(int i = 0; i < num_segments; ++i)
     {
-
-        //更新输入blob
-        boost::shared_ptr<caffe::Blob<float> > input_blob =
-                feature_extraction_net->blob_by_name("data");
-        float *top_data = input_blob->mutable_cpu_data();
-        for(int j = 0; j < batch_size; ++j)
-        {
-            
-            cap >> img_origin;
-            if(!img_origin.empty())
+        threads.push_back(std::thread([&, i]{
+            Caffe::set_mode(Caffe::CPU);    //Caffe的运行模式是线程局部的
+            Tracer::setThreadName("segment " + std::to_string(i));
+            Tracer::setCurrentVideo(video);
+            //各段的第一帧都小于num_of_frames
+            int begin_frame = static_cast<long long>(i) * num_of_frames / num_segments;
+            //最后一段一直处理到视频结束，因为CV_CAP_PROP_FRAME_COUNT可能不准确
+            int end_frame = (i == num_segments - 1) ? INT_MAX : static_cast<long long>(i + 1) * num_of_frames / num_segments;
+            int decode_end = (end_frame == INT_MAX) ? INT_MAX : end_frame + max_rate;
+            cv::VideoCapture segment_cap;
+            segment_cap.open(video_file);
+            if(!segment_cap.isOpened() || !seekToFrame(segment_cap, begin_frame))
             {
-                cv::resize(img_origin,img,cv::Size(new_width,new_height));
-                int offset = input_blob->offset(j);
-                
-                int top_index = offset;
-                for(int h = 0; h < new_height; ++h)
-                {
-                    const uchar* ptr = img.ptr<uchar>(h);
-                    int img_index = 0;
-                    for(int w = 0; w < new_width;++w)
-                        for(int c = 0; c < channels;++c)
-                        {
-                            top_index = offset + (c * height + h) * width + w;
-                            top_data[top_index] = static_cast<float>(ptr[img_index++]);
-                        }
-                }
-                ++window_end;
-            }   
-        }   //完成输入图像数据的设置
-        LOG(ERROR) << "extract features of frame " << window_begin << " to frame " << window_end - 1;
-        feature_extraction_net->Forward();//提取特征
-        for(size_t feature_index = 0; feature_index < num_features;++feature_index)
-        {
-            const boost::shared_ptr<caffe::Blob<float> > feature_blob =
-                feature_extraction_net->blob_by_name(blob_names[feature_index]);
-            int dim_features = feature_blob->count() / batch_size;  //特征的维度
-            const float *feature_blob_data = feature_blob->cpu_data();  //所有图像的特征数据
-            //计算不同采样率上的距离
-            for(size_t rate_index = 0; rate_index < all_rates.size(); ++rate_index )
+                LOG(ERROR) << "cannot seek to frame " << begin_frame << " of " << video_file << " accurately";
+                results[i] = 1;
+                return;
+            }
+            segment_states[i].reset(begin_frame, end_frame);
+            extractors[i]->setProfile(profile);
+            int decoded_end = extractors[i]->extract(segment_cap, segment_states[i], begin_frame, decode_end);
+            extractors[i]->setProfile(nullptr);
+            if(decoded_end < std::min(decode_end, num_of_frames))
             {
-                const float *frame1 = nullptr;
-                const float *frame2 = nullptr;
-                while(to_compare[feature_index][rate_index] + all_rates[rate_index] < window_end)
-                {
-                    int frame1_no = to_compare[feature_index][rate_index];
-                    if(frame1 == nullptr)
-                    {
-                        //该滑动窗口上的第一次比较
-                        if(frame1_no >= window_begin)
-                            frame1 = feature_blob_data + feature_blob->offset(frame1_no - window_begin);
-                        else
-                            frame1 = last_compare[feature_index][rate_index].get();
-                    }
-                    frame2 = feature_blob_data + feature_blob->offset(frame1_no + all_rates[rate_index] - window_begin);
-                    float distance = calculator->calculate(frame1,frame2,dim_features);
-                    
-                    all_distances[feature_index][rate_index].push_back(std::make_pair(frame1_no,distance));
-                    to_compare[feature_index][rate_index] += all_rates[rate_index];
-                    frame1 = frame2;     
-                }
-                if(to_compare[feature_index][rate_index] >= window_begin)
-                {
-                    const float *last_frame = feature_blob_data + feature_blob->offset(to_compare[feature_index][rate_index] - window_begin);
-                    //拷贝数据
-                    float *feature_data = new float[dim_features];
-                    for(int d = 0; d < dim_features; ++d)
-                        feature_data[d] = last_frame[d];
-                    last_compare[feature_index][rate_index].reset(feature_data);
-                }
+                LOG(ERROR) << "segment " << i << " of " << video_file << " ends at frame " << decoded_end << ", expected "
+                    << std::min(decode_end, num_of_frames);
+                results[i] = 1;
             }
-                
-        }//完成不同特征在不同采样率上的距离计算
-        window_begin = window_end;
-        window_end = window_begin;
+        }));
     }
-    auto pos = video_file.rfind('/');
-    string video_name;
-    if(pos == string::npos)
-        video_name = video_file;
-    else
-        video_name = video_file.substr(pos+1);
-    // //打印distance以调试
-    // for(size_t feature_index = 0; feature_index < num_features; ++feature_index)
-    // {
-    //     auto pos = video_file.rfind('/');
-    //     string video_name;
-    //     if(pos == string::npos)
-    //         video_name = video_file;
-    //     else
-    //         video_name = video_file.substr(pos+1);
-    //     string prefix(output_dir);
-    //     if(output_dir.back() != '/')
-    //         prefix.push_back('/');
+    for(auto &thread : threads)
+        thread.join();
+    for(int i = 0; i < num_segments; ++i)
+    {
+        if(results[i])
+        {
+            LOG(ERROR) << "fall back to serial processing of " << video_file;
+            state.reset();
+            return processVideo(video_file, *extractors[0], state, output_dir, store, selector, save_distances, profile);
+        }
+    }
+    for(int i = 0; i < num_segments; ++i)
+        state.append(segment_states[i]);
+    return outputCandidates(video_file, extractors[0]->blobNames(), state, output_dir, selector, save_distances, profile);
+}
 
-    //     prefix = prefix + video_name + "_"+blob_names[feature_index] + "_";
-    //     for(size_t rate_index = 0; rate_index < all_rates.size();++rate_index)
-    //     {
-    //         string file_name(prefix + std::to_string(all_rates[rate_index]));
-    //         std::ofstream of(file_name);
-    //         if(!of.is_open())
-    //         {
-    //             LOG(ERROR) << "cannot create the file " << file_name;
-    //             return 1;
-    //         }
-    //         for(size_t j = 0; j < all_distances[feature_index][rate_index].size();++j)
-    //         {
-    //             of << std::setw(10) << std::setfill('0') << all_distances[feature_index][rate_index][j].first << " " 
-    //                 << all_distances[feature_index][rate_index][j].second << std::endl;
-    //         }
-    //         of.close();
-    //     }
-    // }
+//将cap定位到第frame_no帧，之后读取的第一帧就是第frame_no帧，定位精确时返回true
+//set之后立即get(CV_CAP_PROP_POS_FRAMES)通常只返回设置的值，不能说明定位是否精确，
+//因此先定位到第frame_no - 1帧并解码，用这一帧的时间戳CV_CAP_PROP_POS_MSEC和(frame_no - 1) / fps比较，误差小于半帧才算精确
+//帧率未知或可变帧率的视频返回false
+bool seekToFrame(cv::VideoCapture &cap, int frame_no)
+{
+    if(frame_no == 0)
+        return true;
+    const double fps = cap.get(CV_CAP_PROP_FPS);
+    if(!(fps > 0))
+        return false;
+    cap.set(CV_CAP_PROP_POS_FRAMES, frame_no - 1);
+    if(!cap.grab())
+        return false;
+    const double expected_msec = (frame_no - 1) * 1000.0 / fps;
+    return std::abs(cap.get(CV_CAP_PROP_POS_MSEC) - expected_msec) < 500.0 / fps;
+}
+
+//计算视频文件的哈希作为特征缓存的键，需要读取整个文件，在trace中单独显示
+bool hashVideo(const FeatureStore &store, const string &video_file, uint64_t &video_hash)
+{
+    TraceScope trace("hash_video");
+    return store.hashVideo(video_file, video_hash);
+}
+
+//对各个特征的距离序列执行过滤算法，合并不同采样率上的candidate并输出，save_distances时同时保存距离序列
+//成功返回0，失败返回1
+int outputCandidates(const string &video_file, const vector<string> &blob_names, const DistanceState &state, const string &output_dir,
+    const CandidateSelector &selector, bool save_distances, StageProfile *profile)
+{
+    const vector<int> &all_rates = state.rates();
+    size_t num_features = blob_names.size();
+    if(save_distances)
+    {
+        ScopedTimer timer(profile, kOutputStage);
+        TraceScope trace("save_distances");
+        for(size_t feature_index = 0; feature_index < num_features; ++feature_index)
+        {
+            string distances_file = candidatesFile(video_file, blob_names[feature_index], output_dir, "_distances");
+            if(distances_file.empty() || saveDistances(distances_file, state, feature_index))
+                return 1;
+        }
+    }
     for(size_t feature_index = 0; feature_index < num_features;++feature_index)
     {
-        vector<vector<int>> initial_candidates;
-        float a = 0.7;
-        int window_size = 16;
+        vector<const vector<pair<int,float>>*> sequences;
         for(size_t rate_index = 0; rate_index < all_rates.size();++rate_index)
+            sequences.push_back(&state.distances(feature_index,rate_index));
+        vector<vector<int>> candidates_at_all_rates;
         {
-            vector<int> temp = filtering(all_distances[feature_index][rate_index],a,window_size);
-            initial_candidates.push_back(temp);
+            ScopedTimer timer(profile, kFilterStage);
+            TraceScope trace("filter");
+            selector.filter(sequences, candidates_at_all_rates);
+        }
+        vector<int> all;
+        {
+            ScopedTimer timer(profile, kMergeStage);
+            TraceScope trace("merge");
+            mergeCandidates(candidates_at_all_rates, selector.min_space, all);
         }
-        vector<int> all = merge_candidates(initial_candidates);
         //输出结果文件
-        string output_file(output_dir);
-        if(output_dir.back() != '/')
-            output_file.push_back('/');
-        output_file += blob_names[feature_index] + "/";
-        path dir_name(output_file);
-        if(!exists(dir_name))
-            if(!create_directory(dir_name))
-            {
-                LOG(ERROR) << "cannot create the directory " << dir_name;
-                return 1;
-            }
-        output_file += video_name +"_candidates";
+        ScopedTimer timer(profile, kOutputStage);
+        TraceScope trace("write_candidates");
+        string output_file = candidatesFile(video_file, blob_names[feature_index], output_dir);
+        if(output_file.empty())
+            return 1;
         std::ofstream output(output_file);
         if(!output.is_open())
         {
@@ -352,108 +566,36 @@ int processVideo(const string &video_file, const string &pretrained_binary_proto
     return 0;
 }
 
-//candidate seletction
-//算法1
-//T = local_mean + a * local_sigma * (1 + ln(global_mean / local_mean))
-//当d(i) > T 或者 d(i)比其相邻的大很多时，认为该帧是candidate
-vector<int> filtering(const vector<std::pair<int,float>> &distances, float a, int window_size)
+//把profile写入output_dir/第一个特征名/视频名_report.json，和candidate文件放在一起，profile为nullptr时不输出
+//成功返回0，失败返回1
+int writeReport(const string &video_file, const vector<string> &blob_names, const string &output_dir, const StageProfile *profile)
 {
-    float window_sum = 0.0;
-    float window_square_sum = 0.0;
-    size_t window_start = 0;
-    size_t window_end = 2 * window_size - 2;
-    
-    vector<int> candidates;
-    if(distances.empty())
-        return candidates;
+    if(profile == nullptr)
+        return 0;
+    string report_file = candidatesFile(video_file, blob_names[0], output_dir, "_report.json");
+    if(report_file.empty())
+        return 1;
+    return profile->writeReport(report_file, video_file);
+}
 
-    //计算全局平均值
-    float global_mean = 0.0;
-    float sum = 0.0;
-    for(size_t i = 0; i < distances.size();++i)
-        sum += distances[i].second;
-    global_mean = sum / distances.size();
-    
-    int frame_no = window_start + window_size - 1;
-    for(size_t i = window_start; i <= window_end;++i)
+//保存第feature_index个特征在所有采样率上的距离序列，每个采样率以"rate 采样率 距离个数"一行开始，
+//之后每行为"帧序号 距离"
+//成功返回0，失败返回1
+int saveDistances(const string &output_file, const DistanceState &state, size_t feature_index)
+{
+    std::ofstream output(output_file);
+    if(!output.is_open())
     {
-        window_sum += distances[i].second;
-        window_square_sum += distances[i].second * distances[i].second;
+        LOG(ERROR) << "cannot create the file " << output_file;
+        return 1;
     }
-        
-    while(window_end < distances.size())
+    output << std::setprecision(9);
+    for(size_t rate_index = 0; rate_index < state.rates().size(); ++rate_index)
     {
-        //计算local mean ,local standard deviation
-        float local_mean = window_sum / (2 * window_size -1); 
-        float local_d = window_square_sum - 2* local_mean * window_sum + (2 * window_size -1) * local_mean *local_mean;
-        
-        local_d = std::sqrt(local_d / (2 * window_size - 2));
-        //计算threshold
-        float threshold = local_mean + a * local_d * (1 + std::log(global_mean / local_mean));
-        if(distances[frame_no] .second > threshold)
-            candidates.push_back(distances[frame_no].first);
-        else{
-            if((distances[frame_no].second > 3 * distances[frame_no - 1].second 
-                || distances[frame_no].second > 3 * distances[frame_no + 1].second)
-                && distances[frame_no].second > 0.8 * global_mean)
-                candidates.push_back(distances[frame_no].first);
-        }
-        //滑动窗口
-        ++frame_no;
-        window_sum -= distances[window_start].second;
-        window_square_sum -= distances[window_start].second * distances[window_start].second;
-        ++window_end;
-        ++window_start;
-        if(window_end < distances.size())
-        {
-            window_sum += distances[window_end].second;
-            window_square_sum += distances[window_end].second * distances[window_end].second;
-        }
-            
+        const vector<pair<int,float>> &distances = state.distances(feature_index, rate_index);
+        output << "rate " << state.rates()[rate_index] << " " << distances.size() << "\n";
+        for(const auto &item : distances)
+            output << item.first << " " << item.second << "\n";
     }
-    return candidates;
-    
+    return output.good() ? 0 : 1;
 }
-//合并不同采样率得到的candidate
-vector<int> merge_candidates(vector<vector<int>> &candidates_at_all_sampleRates)
-{
-    
-    vector<int> result;
-    if(candidates_at_all_sampleRates.empty())
-        return result;
-    std::list<int> temp(candidates_at_all_sampleRates[0].begin(),candidates_at_all_sampleRates[0].end());
-    const int min_space = 5;    //不同采样率之间的候选帧之间的最小间隔
-    for(size_t i = 1; i < candidates_at_all_sampleRates.size();++i)
-    {
-        auto it = temp.begin();
-        auto prev_it = temp.end();
-        for(size_t j = 0; j < candidates_at_all_sampleRates[i].size();++j)
-        {
-            while(it != temp.end() && *it < candidates_at_all_sampleRates[i][j])
-            {
-                prev_it = it;
-                ++it;
-            }
-           
-            //如果不同采样率的candidates相隔太近，则只保留低采样率的candidates
-            if(it == temp.begin())
-            {
-                if(*it >= candidates_at_all_sampleRates[i][j] + min_space)
-                    temp.insert(it, candidates_at_all_sampleRates[i][j]);
-            }else if(it == temp.end())
-            {
-                if(candidates_at_all_sampleRates[i][j] >= *prev_it + min_space)
-                    temp.insert(it, candidates_at_all_sampleRates[i][j]);
-            }else
-            {
-                if(*it >= candidates_at_all_sampleRates[i][j] + min_space 
-                    && candidates_at_all_sampleRates[i][j] >= *prev_it + min_space)
-                    temp.insert(it, candidates_at_all_sampleRates[i][j]);
-            }
-            
-        }
-    }
-    result.resize(temp.size());
-    std::copy(temp.begin(),temp.end(),result.begin());
-    return result;
-}
\ No newline at end of file
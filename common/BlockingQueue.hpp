@@ -0,0 +1,85 @@
+/*
+**有界阻塞队列，用于在流水线的各个阶段(线程)之间传递数据，Distance和calculateDistance共用，只有头文件*
+**队列满时push阻塞，队列空时pop阻塞，close之后所有等待的线程都会被唤醒*
+**定义了BLOCKINGQUEUE_TRACE时(需要链接calculateDistance/Trace.cpp)，阻塞的时间记录为trace中的wait_push和wait_pop事件，*
+**用于查找流水线中的停顿；否则不记录，也不依赖Trace.hpp*
+*/
+#ifndef BLOCKINGQUEUE_HPP_
+#define BLOCKINGQUEUE_HPP_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef BLOCKINGQUEUE_TRACE
+#include "Trace.hpp"
+typedef TraceScope QueueWaitScope;
+#else
+//不记录trace时的空实现
+class QueueWaitScope{
+public:
+    explicit QueueWaitScope(const char*){}
+};
+#endif
+
+template <typename T>
+class BlockingQueue{
+public:
+    explicit BlockingQueue(size_t capacity):m_capacity(capacity),m_closed(false){}
+    //放入一个元素，队列已关闭时返回false
+    bool push(const T &item);
+    //取出一个元素，队列已关闭并且为空时返回false
+    bool pop(T &item);
+    //关闭队列，之后不能再放入元素，但可以取出剩余的元素
+    void close();
+private:
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+    std::mutex m_mutex;
+    std::condition_variable m_not_full;
+    std::condition_variable m_not_empty;
+};
+
+template <typename T>
+bool BlockingQueue<T>::push(const T &item)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if(!m_closed && m_items.size() >= m_capacity)
+    {
+        QueueWaitScope wait("wait_push");
+        m_not_full.wait(lock, [this]{ return m_closed || m_items.size() < m_capacity; });
+    }
+    if(m_closed)
+        return false;
+    m_items.push_back(item);
+    m_not_empty.notify_one();
+    return true;
+}
+
+template <typename T>
+bool BlockingQueue<T>::pop(T &item)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if(!m_closed && m_items.empty())
+    {
+        QueueWaitScope wait("wait_pop");
+        m_not_empty.wait(lock, [this]{ return m_closed || !m_items.empty(); });
+    }
+    if(m_items.empty())
+        return false;
+    item = m_items.front();
+    m_items.pop_front();
+    m_not_full.notify_one();
+    return true;
+}
+
+template <typename T>
+void BlockingQueue<T>::close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_not_full.notify_all();
+    m_not_empty.notify_all();
+}
+#endif
@@ -0,0 +1,476 @@
+/*
+**各种距离度量的向量化实现，运行时根据CPU支持的指令集选择AVX-512、AVX2或标量版本*
+**常用的特征维度(SqueezeNet的prob和pool10都是1000维)有编译期确定长度的特化版本*
+**只依赖标准库和编译器内建函数，不依赖caffe，Distance和calculateDistance共用*
+*/
+#ifndef DISTANCEKERNELS_HPP_
+#define DISTANCEKERNELS_HPP_
+
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DISTANCE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+//支持的距离度量
+enum KernelMetric{
+    kCosine,            //1 - a.b / (|a| * |b|)
+    kSquaredL2,         //sum((a - b)^2)
+    kL1,                //sum(|a - b|)
+    kChiSquare,         //sum((a - b)^2 / (a + b))，跳过a + b <= 0的维度，用于非负的特征
+    kHistIntersection,  //1 - sum(min(a, b)) / max(sum(a), sum(b))，用于非负的特征
+    kHamming,           //把特征按是否大于0二值化后，不同的维度所占的比例
+    kNumMetrics
+};
+
+//编译期特化的特征维度
+const int kSpecializedDim = 1000;
+
+typedef float (*DistanceKernel)(const float *a, const float *b, int n);
+
+//一组指令集上的所有距离度量
+struct KernelTable{
+    const char *isa;
+    DistanceKernel generic[kNumMetrics];    //任意维度
+    DistanceKernel fixed[kNumMetrics];      //维度为kSpecializedDim
+};
+
+//由距离度量的名字得到KernelMetric，未知的名字返回false
+inline bool kernelMetricFromName(const std::string &type, KernelMetric &metric)
+{
+    static const char *names[kNumMetrics] = {"Cosine", "L2", "L1", "ChiSquare", "HistIntersection", "Hamming"};
+    for(int i = 0; i < kNumMetrics; ++i)
+    {
+        if(type == names[i])
+        {
+            metric = static_cast<KernelMetric>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+//用double累加的标量参考实现，用于校验各个指令集上的版本，也用于float以外的类型
+template <typename T>
+T referenceDistance(KernelMetric metric, const T *a, const T *b, int n)
+{
+    double s0 = 0, s1 = 0, s2 = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        double x = a[i], y = b[i];
+        switch(metric)
+        {
+        case kCosine: s0 += x * y; s1 += x * x; s2 += y * y; break;
+        case kSquaredL2: s0 += (x - y) * (x - y); break;
+        case kL1: s0 += std::fabs(x - y); break;
+        case kChiSquare: if(x + y > 0) s0 += (x - y) * (x - y) / (x + y); break;
+        case kHistIntersection: s0 += std::min(x, y); s1 += x; s2 += y; break;
+        case kHamming: s0 += (x > 0) != (y > 0); break;
+        default: break;
+        }
+    }
+    switch(metric)
+    {
+    case kCosine: return 1 - s0 / (std::sqrt(s1) * std::sqrt(s2));
+    case kHistIntersection: return std::max(s1, s2) > 0 ? 1 - s0 / std::max(s1, s2) : 0;
+    case kHamming: return n > 0 ? s0 / n : 0;
+    default: return s0;
+    }
+}
+
+//标量版本，N > 0时维度在编译期确定为N
+template <int N>
+float cosineScalar(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    float dot = 0, aa = 0, bb = 0;
+    for(int i = 0; i < len; ++i)
+    {
+        dot += a[i] * b[i];
+        aa += a[i] * a[i];
+        bb += b[i] * b[i];
+    }
+    return 1 - dot / (std::sqrt(aa) * std::sqrt(bb));
+}
+
+template <int N>
+float squaredL2Scalar(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    float sum = 0;
+    for(int i = 0; i < len; ++i)
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+template <int N>
+float l1Scalar(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    float sum = 0;
+    for(int i = 0; i < len; ++i)
+        sum += std::fabs(a[i] - b[i]);
+    return sum;
+}
+
+template <int N>
+float chiSquareScalar(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    float sum = 0;
+    for(int i = 0; i < len; ++i)
+    {
+        float s = a[i] + b[i];
+        if(s > 0)
+            sum += (a[i] - b[i]) * (a[i] - b[i]) / s;
+    }
+    return sum;
+}
+
+template <int N>
+float histIntersectionScalar(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    float sum_min = 0, sum_a = 0, sum_b = 0;
+    for(int i = 0; i < len; ++i)
+    {
+        sum_min += std::min(a[i], b[i]);
+        sum_a += a[i];
+        sum_b += b[i];
+    }
+    float total = std::max(sum_a, sum_b);
+    return total > 0 ? 1 - sum_min / total : 0;
+}
+
+template <int N>
+float hammingScalar(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    int count = 0;
+    for(int i = 0; i < len; ++i)
+        count += (a[i] > 0) != (b[i] > 0);
+    return len > 0 ? static_cast<float>(count) / len : 0;
+}
+
+#ifdef DISTANCE_KERNELS_X86
+#define KERNEL_AVX2 __attribute__((target("avx2,fma")))
+#define KERNEL_AVX512 __attribute__((target("avx512f")))
+
+KERNEL_AVX2 inline float horizontalSum(__m256 v)
+{
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_movehdup_ps(x));
+    return _mm_cvtss_f32(x);
+}
+
+//AVX2版本：每次处理8个元素，剩余的元素用标量处理
+template <int N>
+KERNEL_AVX2 float cosineAvx2(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m256 dot = _mm256_setzero_ps(), aa = _mm256_setzero_ps(), bb = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(a + i), y = _mm256_loadu_ps(b + i);
+        dot = _mm256_fmadd_ps(x, y, dot);
+        aa = _mm256_fmadd_ps(x, x, aa);
+        bb = _mm256_fmadd_ps(y, y, bb);
+    }
+    float s_dot = horizontalSum(dot), s_aa = horizontalSum(aa), s_bb = horizontalSum(bb);
+    for(; i < len; ++i)
+    {
+        s_dot += a[i] * b[i];
+        s_aa += a[i] * a[i];
+        s_bb += b[i] * b[i];
+    }
+    return 1 - s_dot / (std::sqrt(s_aa) * std::sqrt(s_bb));
+}
+
+template <int N>
+KERNEL_AVX2 float squaredL2Avx2(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    float sum = horizontalSum(acc);
+    for(; i < len; ++i)
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+template <int N>
+KERNEL_AVX2 float l1Avx2(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_add_ps(acc, _mm256_andnot_ps(sign, d));
+    }
+    float sum = horizontalSum(acc);
+    for(; i < len; ++i)
+        sum += std::fabs(a[i] - b[i]);
+    return sum;
+}
+
+template <int N>
+KERNEL_AVX2 float chiSquareAvx2(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(a + i), y = _mm256_loadu_ps(b + i);
+        __m256 s = _mm256_add_ps(x, y), d = _mm256_sub_ps(x, y);
+        //a + b <= 0的维度的商可能是inf或nan，用掩码置为0
+        __m256 q = _mm256_div_ps(_mm256_mul_ps(d, d), s);
+        acc = _mm256_add_ps(acc, _mm256_and_ps(q, _mm256_cmp_ps(s, zero, _CMP_GT_OQ)));
+    }
+    float sum = horizontalSum(acc);
+    for(; i < len; ++i)
+    {
+        float s = a[i] + b[i];
+        if(s > 0)
+            sum += (a[i] - b[i]) * (a[i] - b[i]) / s;
+    }
+    return sum;
+}
+
+template <int N>
+KERNEL_AVX2 float histIntersectionAvx2(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m256 acc_min = _mm256_setzero_ps(), acc_a = _mm256_setzero_ps(), acc_b = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(a + i), y = _mm256_loadu_ps(b + i);
+        acc_min = _mm256_add_ps(acc_min, _mm256_min_ps(x, y));
+        acc_a = _mm256_add_ps(acc_a, x);
+        acc_b = _mm256_add_ps(acc_b, y);
+    }
+    float sum_min = horizontalSum(acc_min), sum_a = horizontalSum(acc_a), sum_b = horizontalSum(acc_b);
+    for(; i < len; ++i)
+    {
+        sum_min += std::min(a[i], b[i]);
+        sum_a += a[i];
+        sum_b += b[i];
+    }
+    float total = std::max(sum_a, sum_b);
+    return total > 0 ? 1 - sum_min / total : 0;
+}
+
+template <int N>
+KERNEL_AVX2 float hammingAvx2(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    const __m256 zero = _mm256_setzero_ps();
+    int count = 0;
+    int i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        __m256 x = _mm256_cmp_ps(_mm256_loadu_ps(a + i), zero, _CMP_GT_OQ);
+        __m256 y = _mm256_cmp_ps(_mm256_loadu_ps(b + i), zero, _CMP_GT_OQ);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_xor_ps(x, y)));
+    }
+    for(; i < len; ++i)
+        count += (a[i] > 0) != (b[i] > 0);
+    return len > 0 ? static_cast<float>(count) / len : 0;
+}
+
+//GCC中_mm512_reduce_add_ps和256位的提取指令会产生未初始化变量的警告，这里先存到内存再相加
+KERNEL_AVX512 inline float horizontalSum(__m512 v)
+{
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    float sum = 0;
+    for(int k = 0; k < 16; ++k)
+        sum += lanes[k];
+    return sum;
+}
+
+//AVX-512版本：每次处理16个元素，剩余的元素用掩码加载，不需要标量的收尾
+template <int N>
+KERNEL_AVX512 float cosineAvx512(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m512 dot = _mm512_setzero_ps(), aa = _mm512_setzero_ps(), bb = _mm512_setzero_ps();
+    for(int i = 0; i < len; i += 16)
+    {
+        __mmask16 mask = len - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (len - i)) - 1);
+        __m512 x = _mm512_maskz_loadu_ps(mask, a + i), y = _mm512_maskz_loadu_ps(mask, b + i);
+        dot = _mm512_fmadd_ps(x, y, dot);
+        aa = _mm512_fmadd_ps(x, x, aa);
+        bb = _mm512_fmadd_ps(y, y, bb);
+    }
+    return 1 - horizontalSum(dot) / (std::sqrt(horizontalSum(aa)) * std::sqrt(horizontalSum(bb)));
+}
+
+template <int N>
+KERNEL_AVX512 float squaredL2Avx512(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m512 acc = _mm512_setzero_ps();
+    for(int i = 0; i < len; i += 16)
+    {
+        __mmask16 mask = len - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (len - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return horizontalSum(acc);
+}
+
+template <int N>
+KERNEL_AVX512 float l1Avx512(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m512 acc = _mm512_setzero_ps();
+    for(int i = 0; i < len; i += 16)
+    {
+        __mmask16 mask = len - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (len - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(d));
+    }
+    return horizontalSum(acc);
+}
+
+template <int N>
+KERNEL_AVX512 float chiSquareAvx512(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    const __m512 zero = _mm512_setzero_ps();
+    __m512 acc = _mm512_setzero_ps();
+    for(int i = 0; i < len; i += 16)
+    {
+        __mmask16 mask = len - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (len - i)) - 1);
+        __m512 x = _mm512_maskz_loadu_ps(mask, a + i), y = _mm512_maskz_loadu_ps(mask, b + i);
+        __m512 s = _mm512_add_ps(x, y), d = _mm512_sub_ps(x, y);
+        __mmask16 positive = _mm512_cmp_ps_mask(s, zero, _CMP_GT_OQ);
+        acc = _mm512_add_ps(acc, _mm512_maskz_div_ps(positive, _mm512_mul_ps(d, d), s));
+    }
+    return horizontalSum(acc);
+}
+
+template <int N>
+KERNEL_AVX512 float histIntersectionAvx512(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    __m512 acc_min = _mm512_setzero_ps(), acc_a = _mm512_setzero_ps(), acc_b = _mm512_setzero_ps();
+    for(int i = 0; i < len; i += 16)
+    {
+        __mmask16 mask = len - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (len - i)) - 1);
+        __m512 x = _mm512_maskz_loadu_ps(mask, a + i), y = _mm512_maskz_loadu_ps(mask, b + i);
+        acc_min = _mm512_add_ps(acc_min, _mm512_maskz_min_ps(mask, x, y));
+        acc_a = _mm512_add_ps(acc_a, x);
+        acc_b = _mm512_add_ps(acc_b, y);
+    }
+    float sum_min = horizontalSum(acc_min);
+    float total = std::max(horizontalSum(acc_a), horizontalSum(acc_b));
+    return total > 0 ? 1 - sum_min / total : 0;
+}
+
+template <int N>
+KERNEL_AVX512 float hammingAvx512(const float *a, const float *b, int n)
+{
+    const int len = N > 0 ? N : n;
+    const __m512 zero = _mm512_setzero_ps();
+    int count = 0;
+    for(int i = 0; i < len; i += 16)
+    {
+        __mmask16 mask = len - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (len - i)) - 1);
+        __mmask16 x = _mm512_mask_cmp_ps_mask(mask, _mm512_maskz_loadu_ps(mask, a + i), zero, _CMP_GT_OQ);
+        __mmask16 y = _mm512_mask_cmp_ps_mask(mask, _mm512_maskz_loadu_ps(mask, b + i), zero, _CMP_GT_OQ);
+        count += __builtin_popcount(static_cast<unsigned>(x ^ y));
+    }
+    return len > 0 ? static_cast<float>(count) / len : 0;
+}
+#endif
+
+#define KERNEL_TABLE(name, suffix) {name, \
+    {cosine##suffix<0>, squaredL2##suffix<0>, l1##suffix<0>, chiSquare##suffix<0>, histIntersection##suffix<0>, hamming##suffix<0>}, \
+    {cosine##suffix<kSpecializedDim>, squaredL2##suffix<kSpecializedDim>, l1##suffix<kSpecializedDim>, \
+     chiSquare##suffix<kSpecializedDim>, histIntersection##suffix<kSpecializedDim>, hamming##suffix<kSpecializedDim>}}
+
+inline const KernelTable& scalarKernels()
+{
+    static const KernelTable table = KERNEL_TABLE("scalar", Scalar);
+    return table;
+}
+
+//当前CPU不支持的指令集返回nullptr
+inline const KernelTable* avx2Kernels()
+{
+#ifdef DISTANCE_KERNELS_X86
+    static const KernelTable table = KERNEL_TABLE("avx2", Avx2);
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &table;
+#endif
+    return nullptr;
+}
+
+inline const KernelTable* avx512Kernels()
+{
+#ifdef DISTANCE_KERNELS_X86
+    static const KernelTable table = KERNEL_TABLE("avx512", Avx512);
+    if(__builtin_cpu_supports("avx512f"))
+        return &table;
+#endif
+    return nullptr;
+}
+
+//当前CPU上最快的一组实现，只在第一次调用时检测
+inline const KernelTable& distanceKernels()
+{
+    static const KernelTable &table = avx512Kernels() ? *avx512Kernels()
+        : (avx2Kernels() ? *avx2Kernels() : scalarKernels());
+    return table;
+}
+
+//当前CPU上维度为n的向量所用的实现
+inline DistanceKernel selectKernel(KernelMetric metric, int n)
+{
+    const KernelTable &table = distanceKernels();
+    return n == kSpecializedDim ? table.fixed[metric] : table.generic[metric];
+}
+
+inline float computeDistance(KernelMetric metric, const float *a, const float *b, int n)
+{
+    return selectKernel(metric, n)(a, b, n);
+}
+
+template <typename T>
+T computeDistance(KernelMetric metric, const T *a, const T *b, int n)
+{
+    return referenceDistance(metric, a, b, n);
+}
+
+//批量计算时使用的函数对象，float在构造时就选好实现，每对向量只有一次直接的函数调用
+template <typename T>
+struct KernelFunctor{
+    KernelFunctor(KernelMetric metric, int n):metric(metric){}
+    T operator()(const T *a, const T *b, int n) const {return referenceDistance(metric, a, b, n);}
+    KernelMetric metric;
+};
+
+template <>
+struct KernelFunctor<float>{
+    KernelFunctor(KernelMetric metric, int n):kernel(selectKernel(metric, n)){}
+    float operator()(const float *a, const float *b, int n) const {return kernel(a, b, n);}
+    DistanceKernel kernel;
+};
+#endif
@@ -0,0 +1,173 @@
+/*
+**二进制特征文件：文件头 + 按行连续存放的特征，第i行为第i * frame_step帧的特征*
+**写入时先写到临时文件，close()时再写入文件头并改名，中途失败不会留下不完整的文件*
+**读取时内存映射整个文件，每一行的特征直接通过指针访问，不需要解析*
+**ExtractFeatures写入，Distance和calculateDistance读取，三者共用这一个头文件*
+*/
+#ifndef FEATUREFILE_HPP_
+#define FEATUREFILE_HPP_
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const uint32_t kFeatureFileVersion = 2;
+const uint32_t kFeatureFloat32 = 0;     //目前只支持float特征
+
+//特征文件的文件头，大小为32字节，之后紧跟num_frames * dim个元素
+struct FeatureFileHeader{
+    char magic[4];          //"FEAT"
+    uint32_t version;
+    uint32_t dtype;         //元素的类型
+    uint32_t dim;           //特征的维度
+    uint32_t frame_step;    //第i行特征对应第i * frame_step帧
+    uint32_t reserved;
+    uint64_t num_frames;    //特征的行数
+};
+
+//顺序写入一个特征文件
+class FeatureFileWriter{
+public:
+    FeatureFileWriter(){}
+    ~FeatureFileWriter();
+    int open(const std::string &file_name, int dim, int frame_step = 1);  //成功返回0，失败返回1
+    bool isOpen() const {return m_output.is_open();}
+    void append(const float *rows, size_t num_rows);   //追加num_rows行特征
+    uint64_t numFrames() const {return m_header.num_frames;}
+    int close();    //写入文件头并改名为正式的文件名，成功返回0，失败返回1
+private:
+    FeatureFileWriter(const FeatureFileWriter&);
+    FeatureFileWriter& operator=(const FeatureFileWriter&);
+
+    std::string m_file_name;
+    std::string m_temp_name;
+    std::ofstream m_output;
+    FeatureFileHeader m_header;
+};
+
+//以只读方式内存映射一个特征文件
+class FeatureFileReader{
+public:
+    FeatureFileReader():m_data(nullptr),m_size(0),m_rows(nullptr){}
+    ~FeatureFileReader(){close();}
+    int open(const std::string &file_name);  //成功返回0，文件不存在或格式不对返回1
+    void close();
+    int dim() const {return m_header.dim;}
+    int frameStep() const {return m_header.frame_step;}
+    size_t numFrames() const {return m_header.num_frames;}
+    const float* row(size_t i) const {return m_rows + i * m_header.dim;}   //第i * frameStep()帧的特征
+private:
+    FeatureFileReader(const FeatureFileReader&);
+    FeatureFileReader& operator=(const FeatureFileReader&);
+
+    void *m_data;
+    size_t m_size;
+    FeatureFileHeader m_header;
+    const float *m_rows;
+};
+
+inline FeatureFileWriter::~FeatureFileWriter()
+{
+    //没有调用close()，删除不完整的临时文件
+    if(m_output.is_open())
+    {
+        m_output.close();
+        std::remove(m_temp_name.c_str());
+    }
+}
+
+inline int FeatureFileWriter::open(const std::string &file_name, int dim, int frame_step)
+{
+    m_file_name = file_name;
+    //同一个文件可能同时被多个线程写入，临时文件名要各不相同
+    std::ostringstream temp_name;
+    temp_name << file_name << ".tmp" << getpid() << "_" << std::hash<std::thread::id>()(std::this_thread::get_id());
+    m_temp_name = temp_name.str();
+    std::memcpy(m_header.magic, "FEAT", 4);
+    m_header.version = kFeatureFileVersion;
+    m_header.dtype = kFeatureFloat32;
+    m_header.dim = dim;
+    m_header.frame_step = frame_step;
+    m_header.reserved = 0;
+    m_header.num_frames = 0;
+    m_output.open(m_temp_name, std::ios::binary | std::ios::trunc);
+    if(!m_output.is_open())
+        return 1;
+    //先写入占位的文件头，close()时再写入帧数
+    m_output.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+    return 0;
+}
+
+inline void FeatureFileWriter::append(const float *rows, size_t num_rows)
+{
+    m_output.write(reinterpret_cast<const char*>(rows), sizeof(float) * num_rows * m_header.dim);
+    m_header.num_frames += num_rows;
+}
+
+inline int FeatureFileWriter::close()
+{
+    if(!m_output.is_open())
+        return 1;
+    m_output.seekp(0);
+    m_output.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+    m_output.close();
+    if(m_output.fail() || std::rename(m_temp_name.c_str(), m_file_name.c_str()) != 0)
+    {
+        std::remove(m_temp_name.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+inline int FeatureFileReader::open(const std::string &file_name)
+{
+    close();
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if(fd < 0)
+        return 1;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FeatureFileHeader))
+    {
+        ::close(fd);
+        return 1;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);    //映射建立之后就可以关闭文件
+    if(data == MAP_FAILED)
+        return 1;
+    m_data = data;
+    m_size = st.st_size;
+    std::memcpy(&m_header, m_data, sizeof(m_header));
+    if(std::memcmp(m_header.magic, "FEAT", 4) != 0 || m_header.version != kFeatureFileVersion
+        || m_header.dtype != kFeatureFloat32 || m_header.dim == 0 || m_header.frame_step == 0
+        || m_size != sizeof(m_header) + m_header.num_frames * m_header.dim * sizeof(float))
+    {
+        close();
+        return 1;
+    }
+    m_rows = reinterpret_cast<const float*>(static_cast<const char*>(m_data) + sizeof(m_header));
+    madvise(m_data, m_size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+inline void FeatureFileReader::close()
+{
+    if(m_data != nullptr)
+    {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+        m_rows = nullptr;
+    }
+}
+#endif
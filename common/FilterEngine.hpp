@@ -0,0 +1,228 @@
+/*
+**candidate的过滤和多采样率合并算法，Distance和calculateDistance共用，只有头文件*
+**过滤基于距离和距离平方的double前缀和，任意窗口大小上的局部均值和标准差都是O(1)的，*
+**同一个距离序列上的多组参数只需要一次O(n)的预处理*
+**前缀和在减去全局均值之后的距离上累加，长视频(10万以上个距离)上的方差也不会因为相减而损失精度，*
+**累加顺序固定，同样的输入总是得到同样的结果*
+*/
+#ifndef FILTERENGINE_HPP_
+#define FILTERENGINE_HPP_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cmath>
+#include <algorithm>
+
+#include <glog/logging.h>
+
+using std::vector;
+using std::pair;
+
+//过滤算法的参数
+struct FilterParam{
+    enum Formula{
+        kAdaptive,  //算法1：T = local_mean + a * local_sigma * (1 + ln(global_mean / local_mean))，d(i)比相邻的大很多时也选中
+        kStatic     //算法2：T = static_th + a * local_mean
+    };
+    Formula formula;
+    int window_size;    //以第i个距离为中心、长度为2 * window_size - 1的窗口
+    float a;
+    float static_th;    //只用于kStatic
+
+    static FilterParam adaptive(float a, int window_size) {return FilterParam{kAdaptive, window_size, a, 0.0f};}
+    static FilterParam fixed(float sigma, float static_th, int window_size) {return FilterParam{kStatic, window_size, sigma, static_th};}
+    //由名字"adaptive"或"static"得到算法，未知的名字返回false
+    static bool formulaFromName(const std::string &name, Formula &formula)
+    {
+        if(name == "adaptive")
+            formula = kAdaptive;
+        else if(name == "static")
+            formula = kStatic;
+        else
+            return false;
+        return true;
+    }
+};
+
+class FilterEngine{
+public:
+    FilterEngine():m_global_mean(0){}
+    explicit FilterEngine(const vector<pair<int,float>> &distances) {setDistances(distances);}
+    //设置距离序列并计算前缀和，之后的filter都在这个序列上进行
+    void setDistances(const vector<pair<int,float>> &distances);
+    //按param选出candidate的帧序号
+    void filter(const FilterParam &param, vector<int> &candidates) const;
+    //对多组参数选出candidate，candidates[k]对应params[k]，窗口大小相同的参数共用一次局部统计量的计算
+    void filter(const vector<FilterParam> &params, vector<vector<int>> &candidates) const;
+    //每个可以作为窗口中心的距离(第window_size - 1到第n - window_size个)上的局部均值和标准差，
+    //means[k]和sigmas[k]对应第window_size - 1 + k个距离
+    void windowStatistics(int window_size, vector<double> &means, vector<double> &sigmas) const;
+    double globalMean() const {return m_global_mean;}
+    size_t size() const {return m_values.size();}
+private:
+    void select(const FilterParam &param, const vector<double> &means, const vector<double> &sigmas, vector<int> &candidates) const;
+
+    vector<int> m_frame_nos;
+    vector<float> m_values;
+    double m_global_mean;
+    vector<double> m_sum;           //m_sum[i]: 前i个(d - global_mean)的和
+    vector<double> m_square_sum;    //m_square_sum[i]: 前i个(d - global_mean)^2的和
+};
+
+inline void FilterEngine::setDistances(const vector<pair<int,float>> &distances)
+{
+    const size_t n = distances.size();
+    m_frame_nos.resize(n);
+    m_values.resize(n);
+    double total = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        m_frame_nos[i] = distances[i].first;
+        m_values[i] = distances[i].second;
+        total += distances[i].second;
+    }
+    m_global_mean = n > 0 ? total / n : 0;
+    m_sum.resize(n + 1);
+    m_square_sum.resize(n + 1);
+    m_sum[0] = m_square_sum[0] = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        double x = m_values[i] - m_global_mean;
+        m_sum[i + 1] = m_sum[i] + x;
+        m_square_sum[i + 1] = m_square_sum[i] + x * x;
+    }
+}
+
+inline void FilterEngine::windowStatistics(int window_size, vector<double> &means, vector<double> &sigmas) const
+{
+    CHECK_GE(window_size, 2) << "the window size must >= 2";
+    const int n = m_values.size();
+    const int length = 2 * window_size - 1;
+    const int num_centers = std::max(0, n - length + 1);
+    means.resize(num_centers);
+    sigmas.resize(num_centers);
+    //第k个窗口为[k, k + length)，没有分支，编译器可以向量化
+    const double *sum = m_sum.data(), *square_sum = m_square_sum.data();
+    for(int k = 0; k < num_centers; ++k)
+    {
+        double s = sum[k + length] - sum[k];
+        double q = square_sum[k + length] - square_sum[k];
+        means[k] = m_global_mean + s / length;
+        sigmas[k] = std::sqrt(std::max(q - s * s / length, 0.0) / (length - 1));
+    }
+}
+
+inline void FilterEngine::select(const FilterParam &param, const vector<double> &means, const vector<double> &sigmas,
+    vector<int> &candidates) const
+{
+    candidates.clear();
+    const int offset = param.window_size - 1;
+    for(size_t k = 0; k < means.size(); ++k)
+    {
+        const int c = k + offset;
+        const double d = m_values[c];
+        if(param.formula == FilterParam::kStatic)
+        {
+            if(d > param.static_th + param.a * means[k])
+                candidates.push_back(m_frame_nos[c]);
+            continue;
+        }
+        //局部均值为0时阈值为NaN，只看相邻距离的条件
+        double threshold = means[k] + param.a * sigmas[k] * (1 + std::log(m_global_mean / means[k]));
+        if(d > threshold
+            || ((d > 3 * m_values[c - 1] || d > 3 * m_values[c + 1]) && d > 0.8 * m_global_mean))
+            candidates.push_back(m_frame_nos[c]);
+    }
+}
+
+inline void FilterEngine::filter(const FilterParam &param, vector<int> &candidates) const
+{
+    vector<double> means, sigmas;
+    windowStatistics(param.window_size, means, sigmas);
+    select(param, means, sigmas, candidates);
+}
+
+inline void FilterEngine::filter(const vector<FilterParam> &params, vector<vector<int>> &candidates) const
+{
+    candidates.resize(params.size());
+    vector<bool> done(params.size(), false);
+    vector<double> means, sigmas;
+    for(size_t i = 0; i < params.size(); ++i)
+    {
+        if(done[i])
+            continue;
+        windowStatistics(params[i].window_size, means, sigmas);
+        for(size_t j = i; j < params.size(); ++j)
+        {
+            if(!done[j] && params[j].window_size == params[i].window_size)
+            {
+                select(params[j], means, sigmas, candidates[j]);
+                done[j] = true;
+            }
+        }
+    }
+}
+
+//合并不同采样率得到的candidate，candidates_at_all_rates[i]是第i个(递增的)采样率上递增的candidate
+//依次加入各采样率上的candidate，离之前采样率保留的candidate都不少于min_space帧时才加入，
+//即不同采样率的candidate相隔太近时只保留低采样率的candidate，同一采样率的candidate之间不比较
+inline void mergeCandidates(const vector<vector<int>> &candidates_at_all_rates, int min_space, vector<int> &merged)
+{
+    merged.clear();
+    if(candidates_at_all_rates.empty())
+        return;
+    merged = candidates_at_all_rates[0];
+    vector<int> added, result;
+    for(size_t i = 1; i < candidates_at_all_rates.size(); ++i)
+    {
+        added.clear();
+        auto next = merged.begin();
+        for(int candidate : candidates_at_all_rates[i])
+        {
+            while(next != merged.end() && *next < candidate)
+                ++next;
+            if((next == merged.end() || *next >= candidate + min_space)
+                && (next == merged.begin() || candidate >= *(next - 1) + min_space))
+                added.push_back(candidate);
+        }
+        result.resize(merged.size() + added.size());
+        std::merge(merged.begin(), merged.end(), added.begin(), added.end(), result.begin());
+        merged.swap(result);
+    }
+}
+
+//一个视频的一个特征在所有采样率上的candidate选择：每个距离序列分别过滤，再合并
+struct CandidateSelector{
+    FilterParam param;
+    int min_space;      //不同采样率之间的候选帧之间的最小间隔
+
+    CandidateSelector():param(FilterParam::adaptive(0.7f, 16)),min_space(5){}
+    CandidateSelector(const FilterParam &param, int min_space):param(param),min_space(min_space){}
+    //sequences[i]是第i个采样率上的距离序列，candidates_at_all_rates[i]为其上过滤得到的candidate
+    void filter(const vector<const vector<pair<int,float>>*> &sequences, vector<vector<int>> &candidates_at_all_rates) const
+    {
+        FilterEngine engine;
+        candidates_at_all_rates.resize(sequences.size());
+        for(size_t i = 0; i < sequences.size(); ++i)
+        {
+            engine.setDistances(*sequences[i]);
+            engine.filter(param, candidates_at_all_rates[i]);
+        }
+    }
+    //过滤后合并，结果为合并后的candidate
+    void select(const vector<const vector<pair<int,float>>*> &sequences, vector<int> &candidates) const
+    {
+        vector<vector<int>> candidates_at_all_rates;
+        filter(sequences, candidates_at_all_rates);
+        mergeCandidates(candidates_at_all_rates, min_space, candidates);
+    }
+    void select(const vector<vector<pair<int,float>>> &sequences, vector<int> &candidates) const
+    {
+        vector<const vector<pair<int,float>>*> pointers;
+        for(const auto &sequence : sequences)
+            pointers.push_back(&sequence);
+        select(pointers, candidates);
+    }
+};
+#endif